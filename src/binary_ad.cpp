@@ -0,0 +1,182 @@
+
+#include <string.h>
+#include <stdint.h>
+
+#include "binary_ad.h"
+#include "intern_pool.h"
+
+enum BinaryTag {
+    TAG_UNDEFINED = 0,
+    TAG_ERROR,
+    TAG_BOOLEAN,
+    TAG_INTEGER,
+    TAG_REAL,
+    TAG_STRING,
+    TAG_EXPRESSION
+};
+
+template <typename T>
+static void
+put(std::string &buf, T val)
+{
+    buf.append(reinterpret_cast<const char *>(&val), sizeof(T));
+}
+
+static void
+put_string(std::string &buf, const std::string &str)
+{
+    put<uint32_t>(buf, str.size());
+    buf.append(str);
+}
+
+template <typename T>
+static bool
+get(const char *&pos, const char *end, T &val)
+{
+    if (end - pos < static_cast<ssize_t>(sizeof(T))) return false;
+    memcpy(&val, pos, sizeof(T));
+    pos += sizeof(T);
+    return true;
+}
+
+static bool
+get_string(const char *&pos, const char *end, std::string &str)
+{
+    uint32_t len;
+    if (!get(pos, end, len) || end - pos < static_cast<ssize_t>(len)) return false;
+    str.assign(pos, len);
+    pos += len;
+    return true;
+}
+
+void
+serialize_ad(const classad::ClassAd &ad, std::string &buf)
+{
+    classad::ClassAdUnParser unparser;
+    put<uint32_t>(buf, ad.size());
+    for (classad::ClassAd::const_iterator it = ad.begin(); it != ad.end(); it++)
+    {
+        put_string(buf, it->first);
+        classad::Value val;
+        bool is_literal = it->second->GetKind() == classad::ExprTree::LITERAL_NODE;
+        if (is_literal)
+        {
+            static_cast<const classad::Literal *>(it->second)->GetValue(val);
+        }
+        bool bool_val; int int_val; double real_val; std::string str_val;
+        if (!is_literal)
+        {
+            std::string expr_str;
+            unparser.Unparse(expr_str, it->second);
+            put<uint8_t>(buf, TAG_EXPRESSION);
+            put_string(buf, expr_str);
+        }
+        else if (val.IsUndefinedValue())
+        {
+            put<uint8_t>(buf, TAG_UNDEFINED);
+        }
+        else if (val.IsErrorValue())
+        {
+            put<uint8_t>(buf, TAG_ERROR);
+        }
+        else if (val.IsBooleanValue(bool_val))
+        {
+            put<uint8_t>(buf, TAG_BOOLEAN);
+            put<uint8_t>(buf, bool_val);
+        }
+        else if (val.IsIntegerValue(int_val))
+        {
+            put<uint8_t>(buf, TAG_INTEGER);
+            put<int64_t>(buf, int_val);
+        }
+        else if (val.IsRealValue(real_val))
+        {
+            put<uint8_t>(buf, TAG_REAL);
+            put<double>(buf, real_val);
+        }
+        else if (val.IsStringValue(str_val))
+        {
+            put<uint8_t>(buf, TAG_STRING);
+            put_string(buf, str_val);
+        }
+        else
+        {
+            // Times, lists and nested ads round-trip through their text form.
+            std::string expr_str;
+            unparser.Unparse(expr_str, it->second);
+            put<uint8_t>(buf, TAG_EXPRESSION);
+            put_string(buf, expr_str);
+        }
+    }
+}
+
+bool
+deserialize_ad(const char *&pos, const char *end, classad::ClassAd &ad, InternPool *pool)
+{
+    classad::ClassAdParser parser;
+    uint32_t count;
+    if (!get(pos, end, count)) return false;
+    std::string name, str_val;
+    for (uint32_t idx=0; idx<count; idx++)
+    {
+        uint8_t tag;
+        if (!get_string(pos, end, name) || !get(pos, end, tag)) return false;
+        classad::Value val;
+        classad::ExprTree *expr = NULL;
+        uint8_t bool_val; int64_t int_val; double real_val;
+        switch (tag)
+        {
+        case TAG_UNDEFINED:
+            val.SetUndefinedValue();
+            break;
+        case TAG_ERROR:
+            val.SetErrorValue();
+            break;
+        case TAG_BOOLEAN:
+            if (!get(pos, end, bool_val)) return false;
+            val.SetBooleanValue(bool_val);
+            break;
+        case TAG_INTEGER:
+            if (!get(pos, end, int_val)) return false;
+            val.SetIntegerValue(int_val);
+            break;
+        case TAG_REAL:
+            if (!get(pos, end, real_val)) return false;
+            val.SetRealValue(real_val);
+            break;
+        case TAG_STRING:
+            if (!get_string(pos, end, str_val)) return false;
+            val.SetStringValue(pool ? pool->intern(str_val) : str_val);
+            break;
+        case TAG_EXPRESSION:
+            if (!get_string(pos, end, str_val)) return false;
+            if (!(expr = parser.ParseExpression(str_val, true))) return false;
+            break;
+        default:
+            return false;
+        }
+        if (!expr)
+        {
+            expr = classad::Literal::MakeLiteral(val);
+        }
+        // Not through the expression cache, which is shared by all threads.
+        if (!ad.Insert(pool ? pool->intern(name) : name, expr, false))
+        {
+            delete expr;
+            return false;
+        }
+    }
+    return true;
+}
+
+uint64_t
+hash_bytes(const std::string &buf)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (std::string::const_iterator it = buf.begin(); it != buf.end(); it++)
+    {
+        hash ^= static_cast<unsigned char>(*it);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
@@ -0,0 +1,34 @@
+
+#ifndef __BINARY_AD_H_
+#define __BINARY_AD_H_
+
+#include <string>
+#include <stdint.h>
+
+#include "classad/classad_distribution.h"
+
+class InternPool;
+
+/*
+ * A compact binary encoding of ClassAds.
+ *
+ * Literal values are stored in native form and decode without invoking
+ * the ClassAd parser; only attributes holding non-literal expressions are
+ * kept as text.  Integers and lengths are written in host byte order, so
+ * the encoding is only suitable for exchanging ads between processes on
+ * the same host.
+ */
+
+// Append the encoding of ad to buf.
+void serialize_ad(const classad::ClassAd &ad, std::string &buf);
+
+// Decode one ad starting at pos, advancing pos past it.  Names and string
+// values are drawn from pool when one is given.  Returns false if the
+// input is truncated or corrupt.  Like parse_wire_ad, this may run without
+// the module lock once prepare_wire_parsing() has been called.
+bool deserialize_ad(const char *&pos, const char *end, classad::ClassAd &ad, InternPool *pool=NULL);
+
+// A 64-bit FNV-1a hash, for cheaply telling encoded ads and keys apart.
+uint64_t hash_bytes(const std::string &buf);
+
+#endif
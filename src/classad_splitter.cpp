@@ -0,0 +1,108 @@
+
+#include <ctype.h>
+
+#include "classad_splitter.h"
+
+ClassAdSplitter::ClassAdSplitter()
+  : m_pos(0), m_start(std::string::npos), m_depth(0), m_quote(0), m_comment(NO_COMMENT)
+{
+}
+
+bool
+ClassAdSplitter::empty() const
+{
+    return !m_depth && (m_comment != BLOCK_COMMENT);
+}
+
+ClassAdSplitter::Status
+ClassAdSplitter::next(std::string &text)
+{
+    while (m_pos < m_buffer.size())
+    {
+        char c = m_buffer[m_pos];
+        bool have_next = m_pos + 1 < m_buffer.size();
+        char next_c = have_next ? m_buffer[m_pos+1] : '\0';
+        if (m_comment == LINE_COMMENT)
+        {
+            if (c == '\n')
+                m_comment = NO_COMMENT;
+            m_pos++;
+            continue;
+        }
+        if (m_comment == BLOCK_COMMENT)
+        {
+            if (c == '*' && !have_next)
+                break;
+            if (c == '*' && next_c == '/')
+            {
+                m_comment = NO_COMMENT;
+                m_pos++;
+            }
+            m_pos++;
+            continue;
+        }
+        if (m_quote)
+        {
+            if (c == '\\' && !have_next)
+                break;
+            if (c == '\\')
+                m_pos++;
+            else if (c == m_quote)
+                m_quote = 0;
+            m_pos++;
+            continue;
+        }
+        if (c == '/' && !have_next)
+            break;
+        if (c == '/' && (next_c == '/' || next_c == '*'))
+        {
+            m_comment = (next_c == '/') ? LINE_COMMENT : BLOCK_COMMENT;
+            m_pos += 2;
+            continue;
+        }
+        if (!m_depth)
+        {
+            if (isspace(static_cast<unsigned char>(c)))
+            {
+                m_pos++;
+                continue;
+            }
+            if (c != '[')
+            {
+                size_t eol = m_buffer.find('\n', m_pos);
+                text = m_buffer.substr(m_pos, eol == std::string::npos ? eol : eol - m_pos);
+                return SPLIT_ERROR;
+            }
+            m_start = m_pos;
+        }
+        if (c == '"' || c == '\'')
+        {
+            m_quote = c;
+        }
+        else if (c == '[')
+        {
+            m_depth++;
+        }
+        else if (c == ']' && !--m_depth)
+        {
+            m_pos++;
+            text = m_buffer.substr(m_start, m_pos - m_start);
+            m_start = std::string::npos;
+            return SPLIT_AD;
+        }
+        m_pos++;
+    }
+    compact();
+    return SPLIT_NEED_DATA;
+}
+
+// Drop everything before the ad being scanned.
+void
+ClassAdSplitter::compact()
+{
+    size_t keep = (m_start == std::string::npos) ? m_pos : m_start;
+    m_buffer.erase(0, keep);
+    m_pos -= keep;
+    if (m_start != std::string::npos)
+        m_start = 0;
+}
@@ -0,0 +1,49 @@
+
+#ifndef __CLASSAD_SPLITTER_H_
+#define __CLASSAD_SPLITTER_H_
+
+#include <string>
+
+/*
+ * Splits a stream of new-style ClassAds ("[ ... ]") into the text of the
+ * individual ads, without parsing them.  Data may be fed in arbitrary
+ * chunks; only the ad currently being scanned is buffered.
+ */
+class ClassAdSplitter
+{
+public:
+    enum Status {
+        SPLIT_AD,
+        SPLIT_NEED_DATA,
+        SPLIT_ERROR
+    };
+
+    ClassAdSplitter();
+
+    void feed(const char *data, size_t len) { m_buffer.append(data, len); }
+
+    // On SPLIT_AD, text holds the next ad; on SPLIT_ERROR, it holds the
+    // unexpected input found between ads.
+    Status next(std::string &text);
+
+    // True if no partial ad is pending.
+    bool empty() const;
+
+private:
+    enum CommentState {
+        NO_COMMENT,
+        LINE_COMMENT,
+        BLOCK_COMMENT
+    };
+
+    void compact();
+
+    std::string m_buffer;
+    size_t m_pos;
+    size_t m_start;
+    int m_depth;
+    char m_quote;
+    CommentState m_comment;
+};
+
+#endif
@@ -2,12 +2,31 @@
 #include "condor_adtypes.h"
 #include "dc_collector.h"
 #include "condor_version.h"
+#include "condor_config.h"
 
+#include <map>
+#include <set>
 #include <memory>
+#include <limits>
+#include <algorithm>
 #include <boost/python.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/unordered_map.hpp>
 
 #include "old_boost.h"
 #include "classad_wrapper.h"
+#include "query_cache.h"
+#include "binary_ad.h"
+#include "intern_pool.h"
+#include "module_lock.h"
+#include "timing.h"
+#include "deadline.h"
+#include "collector_query.h"
+#include "lazy_ad.h"
+#include "decode_pipeline.h"
+#include "wire_log.h"
+#include "lazy_config.h"
 
 using namespace boost::python;
 
@@ -38,11 +57,439 @@ AdTypes convert_to_ad_type(daemon_t d_type)
     return ad_type;
 }
 
+static void
+check_query_result(QueryResult result)
+{
+    switch (result)
+    {
+    case Q_OK:
+        break;
+    case Q_INVALID_CATEGORY:
+        PyErr_SetString(PyExc_RuntimeError, "Category not supported by query type.");
+        boost::python::throw_error_already_set();
+    case Q_MEMORY_ERROR:
+        PyErr_SetString(PyExc_MemoryError, "Memory allocation error.");
+        boost::python::throw_error_already_set();
+    case Q_PARSE_ERROR:
+        PyErr_SetString(PyExc_SyntaxError, "Query constraints could not be parsed.");
+        boost::python::throw_error_already_set();
+    case Q_COMMUNICATION_ERROR:
+        PyErr_SetString(PyExc_IOError, "Failed communication with collector.");
+        boost::python::throw_error_already_set();
+    case Q_INVALID_QUERY:
+        PyErr_SetString(PyExc_RuntimeError, "Invalid query.");
+        boost::python::throw_error_already_set();
+    case Q_NO_COLLECTOR_HOST:
+        PyErr_SetString(PyExc_RuntimeError, "Unable to determine collector host.");
+        boost::python::throw_error_already_set();
+    default:
+        PyErr_SetString(PyExc_RuntimeError, "Unknown error from collector query.");
+        boost::python::throw_error_already_set();
+    }
+}
+
+// Seconds allowed for each send when the caller gives no deadline.
+#define ADVERTISE_TIMEOUT 20
+
+// Attributes copied into the private ad sent with UPDATE_STARTD_AD_WITH_ACK;
+// the collector keys the private ad like the public one.
+static const char *private_ad_attrs[] = {
+    ATTR_NAME,
+    ATTR_MACHINE,
+    ATTR_MY_ADDRESS,
+    ATTR_STARTD_IP_ADDR,
+    ATTR_CAPABILITY,
+    NULL
+};
+
+static bool
+read_ack(Sock *sock)
+{
+    int ack = 0;
+    sock->decode();
+    return sock->code(ack) && sock->end_of_message() && (ack == 1);
+}
+
+/*
+ * Send ads to one collector with UPDATE_STARTD_AD_WITH_ACK over a single
+ * TCP connection.  Up to PYTHON_ADVERTISE_ACK_WINDOW updates are sent
+ * ahead of their acknowledgements, which the collector returns in order,
+ * so delivery is confirmed without a round trip per ad.
+ */
+static std::string
+send_ads_with_ack(Daemon *collector, const std::vector<boost::shared_ptr<ClassAd> > &ads, Deadline *deadline)
+{
+    size_t window = param_integer("PYTHON_ADVERTISE_ACK_WINDOW", 32, 1);
+    std::auto_ptr<Sock> sock;
+    size_t acked = 0;
+    for (size_t idx=0; idx<ads.size(); idx++)
+    {
+        if (deadline && deadline->poll())
+        {
+            return "Advertise was interrupted.";
+        }
+        int timeout = deadline ? deadline->remaining(ADVERTISE_TIMEOUT) : ADVERTISE_TIMEOUT;
+        if (!sock.get())
+        {
+            sock.reset(collector->startCommand(UPDATE_STARTD_AD_WITH_ACK, Stream::reli_sock, timeout));
+            if (!sock.get())
+                return "Failed to advertise to collector";
+        }
+        else
+        {
+            sock->timeout(timeout);
+            sock->encode();
+            sock->put(UPDATE_STARTD_AD_WITH_ACK);
+        }
+        ClassAd &ad = *ads[idx];
+        ClassAd private_ad;
+        for (const char **attr = private_ad_attrs; *attr; attr++)
+        {
+            classad::ExprTree *expr = ad.Lookup(*attr);
+            if (expr)
+                private_ad.Insert(*attr, expr->Copy());
+        }
+        if (!ad.put(*sock) || !private_ad.put(*sock) || !sock->end_of_message())
+        {
+            return "Failed to advertise to collector";
+        }
+        if (idx + 1 - acked > window)
+        {
+            if (!read_ack(sock.get()))
+                return "Collector did not acknowledge the update";
+            acked++;
+        }
+    }
+    while (acked < ads.size())
+    {
+        if (deadline && deadline->poll())
+        {
+            return "Advertise was interrupted.";
+        }
+        sock->timeout(deadline ? deadline->remaining(ADVERTISE_TIMEOUT) : ADVERTISE_TIMEOUT);
+        if (!read_ack(sock.get()))
+            return "Collector did not acknowledge the update";
+        acked++;
+    }
+    sock->encode();
+    sock->put(DC_NOP);
+    sock->end_of_message();
+    return "";
+}
+
+// Send ads to each collector in the list; returns an error message, or an
+// empty string on success.  Must be called with the module lock held; does
+// not need the GIL.
+static std::string
+send_ads(CollectorList *collectors, int command, bool use_tcp, const std::vector<boost::shared_ptr<ClassAd> > &ads, Deadline *deadline=NULL)
+{
+    collectors->rewind();
+    Daemon *collector;
+    std::auto_ptr<Sock> sock;
+
+    while (collectors->next(collector))
+    {
+        if(!collector->locate()) {
+            return "Unable to locate collector.";
+        }
+        if (command == UPDATE_STARTD_AD_WITH_ACK)
+        {
+            std::string error = send_ads_with_ack(collector, ads, deadline);
+            if (error.size())
+                return error;
+            continue;
+        }
+        sock.reset();
+        for (std::vector<boost::shared_ptr<ClassAd> >::const_iterator it = ads.begin(); it != ads.end(); it++)
+        {
+            if (deadline && deadline->poll())
+            {
+                return "Advertise was interrupted.";
+            }
+            int timeout = deadline ? deadline->remaining(ADVERTISE_TIMEOUT) : ADVERTISE_TIMEOUT;
+            if (use_tcp)
+            {
+                if (!sock.get())
+                    sock.reset(collector->startCommand(command,Stream::reli_sock,timeout));
+                else
+                {
+                    sock->timeout(timeout);
+                    sock->encode();
+                    sock->put(command);
+                }
+            }
+            else
+            {
+                sock.reset(collector->startCommand(command,Stream::safe_sock,timeout));
+            }
+            int result = 0;
+            if (sock.get()) {
+                result += (*it)->put(*sock);
+                result += sock->end_of_message();
+            }
+            if (result != 2) {
+                return "Failed to advertise to collector";
+            }
+        }
+        sock->encode();
+        sock->put(DC_NOP);
+        sock->end_of_message();
+    }
+    return "";
+}
+
+// Seconds to wait before re-sending ads after a failed update.
+#define ADVERTISER_RETRY_DELAY 10
+
+enum AdChange {
+    AD_ADDED,
+    AD_REMOVED,
+    AD_CHANGED
+};
+
+// Attributes rewritten on every update, even when nothing else changed.
+static const char *watch_ignored_attrs[] = {
+    ATTR_LAST_HEARD_FROM,
+    ATTR_UPDATE_SEQUENCE_NUMBER,
+    "UpdatesTotal",
+    "UpdatesSequenced",
+    "UpdatesLost",
+    "UpdatesHistory",
+    "MyCurrentTime",
+    NULL
+};
+
+// Key ads as the collector does: ads of different types, or from different
+// daemons, may share a Name.
+static std::string
+ad_key(const std::string &my_type, const std::string &name, const std::string &address)
+{
+    return my_type + '\n' + name + '\n' + address;
+}
+
+/*
+ * Polls a collector query and reports only the ads added, removed or
+ * changed since the previous poll.
+ *
+ * The previous result is not kept as ads: each ad is reduced to one word
+ * per attribute, packing an attribute name ID with a hash of the value,
+ * so memory use is a small fraction of the ads themselves and Python
+ * objects are only created for ads that changed.
+ */
+struct CollectorWatch
+{
+    CollectorWatch(const std::string &pool, AdTypes ad_type, const std::string &constraint, list attrs, list ignore)
+      : m_collectors(NULL), m_ad_type(ad_type), m_constraint(constraint), m_generation(0)
+    {
+        ensure_config();
+        int len_attrs = py_len(attrs);
+        for (int i=0; i<len_attrs; i++)
+        {
+            std::string attr = extract<std::string>(attrs[i]);
+            m_attrs.push_back(attr);
+        }
+        if (m_attrs.size())
+        {
+            // The ads are keyed on these; see poll.
+            m_attrs.push_back(ATTR_MY_TYPE);
+            m_attrs.push_back(ATTR_NAME);
+            m_attrs.push_back(ATTR_MY_ADDRESS);
+        }
+        for (const char **attr = watch_ignored_attrs; *attr; attr++)
+        {
+            m_ignored.insert(lowercase(*attr));
+        }
+        int len_ignore = py_len(ignore);
+        for (int i=0; i<len_ignore; i++)
+        {
+            std::string attr = extract<std::string>(ignore[i]);
+            m_ignored.insert(lowercase(attr));
+        }
+        ModuleLock lock;
+        m_collectors = pool.size() ? CollectorList::create(pool.c_str()) : CollectorList::create();
+    }
+
+    ~CollectorWatch()
+    {
+        ModuleLock lock;
+        delete m_collectors;
+    }
+
+    list poll(double timeout=0)
+    {
+        std::vector<boost::shared_ptr<ClassAd> > ads;
+        {
+            ModuleLock lock;
+            Deadline deadline(timeout);
+            CondorQuery query(m_ad_type);
+            if (m_constraint.size())
+            {
+                query.addANDConstraint(m_constraint.c_str());
+            }
+            std::vector<const char *> attrs_char;
+            if (m_attrs.size())
+            {
+                for (std::vector<std::string>::const_iterator it = m_attrs.begin(); it != m_attrs.end(); it++)
+                    attrs_char.push_back(it->c_str());
+                attrs_char.push_back(NULL);
+                query.setDesiredAttrs(&attrs_char[0]);
+            }
+            QueryResult result;
+            Py_BEGIN_ALLOW_THREADS
+            result = query_collectors(m_collectors, m_ad_type, query, ads, deadline);
+            Py_END_ALLOW_THREADS
+            deadline.check(result != Q_OK);
+            check_query_result(result);
+        }
+
+        list changes;
+        m_generation++;
+        for (std::vector<boost::shared_ptr<ClassAd> >::const_iterator it = ads.begin(); it != ads.end(); it++)
+        {
+            const ClassAd &ad = **it;
+            std::string my_type, name, address;
+            ad.EvaluateAttrString(ATTR_MY_TYPE, my_type);
+            bool has_name = ad.EvaluateAttrString(ATTR_NAME, name);
+            if (!ad.EvaluateAttrString(ATTR_MY_ADDRESS, address) && !has_name)
+                continue;
+            std::string key = ad_key(my_type, name, address);
+            boost::unordered_map<std::string, Entry>::iterator entry_it = m_ads.find(key);
+            bool added = entry_it == m_ads.end();
+            Entry &entry = added ? m_ads[key] : entry_it->second;
+            entry.generation = m_generation;
+            if (added)
+            {
+                entry.my_type = my_type;
+                entry.name = name;
+                entry.address = address;
+            }
+
+            // An ad with the same sequence number is the same update.
+            int sequence = -1;
+            ad.EvaluateAttrInt(ATTR_UPDATE_SEQUENCE_NUMBER, sequence);
+            if (!added && (sequence >= 0) && (sequence == entry.sequence))
+                continue;
+            entry.sequence = sequence;
+
+            std::vector<uint64_t> attrs;
+            fingerprint(ad, attrs);
+            if (!added && (attrs == entry.attrs))
+                continue;
+            list changed;
+            if (!added)
+                diff(entry.attrs, attrs, changed);
+            entry.attrs.swap(attrs);
+
+            boost::shared_ptr<ClassAdWrapper> wrapper(new ClassAdWrapper());
+            wrapper->CopyFrom(ad);
+            changes.append(boost::python::make_tuple(added ? AD_ADDED : AD_CHANGED, wrapper, changed));
+        }
+
+        for (boost::unordered_map<std::string, Entry>::iterator it = m_ads.begin(); it != m_ads.end(); )
+        {
+            if (it->second.generation == m_generation)
+            {
+                it++;
+                continue;
+            }
+            boost::shared_ptr<ClassAdWrapper> wrapper(new ClassAdWrapper());
+            const Entry &entry = it->second;
+            if (entry.my_type.size())
+                wrapper->InsertAttr(ATTR_MY_TYPE, entry.my_type);
+            if (entry.name.size())
+                wrapper->InsertAttr(ATTR_NAME, entry.name);
+            if (entry.address.size())
+                wrapper->InsertAttr(ATTR_MY_ADDRESS, entry.address);
+            changes.append(boost::python::make_tuple(AD_REMOVED, wrapper, list()));
+            it = m_ads.erase(it);
+        }
+        return changes;
+    }
+
+    size_t size() const
+    {
+        return m_ads.size();
+    }
+
+private:
+    struct Entry
+    {
+        Entry() : sequence(-1), generation(0) {}
+
+        int sequence;
+        unsigned generation;
+        // Sorted (name ID << 32 | value hash) words.
+        std::vector<uint64_t> attrs;
+        // The key attributes, for reporting the ad's removal.
+        std::string my_type, name, address;
+    };
+
+    static std::string lowercase(std::string str)
+    {
+        for (std::string::iterator it = str.begin(); it != str.end(); it++)
+            *it = tolower(*it);
+        return str;
+    }
+
+    uint32_t attrId(const std::string &lower_name, const std::string &name)
+    {
+        std::pair<std::map<std::string, uint32_t>::iterator, bool> result = m_attr_ids.insert(std::make_pair(lower_name, m_attr_names.size()));
+        if (result.second)
+            m_attr_names.push_back(name);
+        return result.first->second;
+    }
+
+    void fingerprint(const ClassAd &ad, std::vector<uint64_t> &attrs)
+    {
+        classad::ClassAdUnParser unparser;
+        std::string value;
+        attrs.reserve(ad.size());
+        for (classad::ClassAd::const_iterator it = ad.begin(); it != ad.end(); it++)
+        {
+            std::string lower_name = lowercase(it->first);
+            if (m_ignored.count(lower_name))
+                continue;
+            value.clear();
+            unparser.Unparse(value, it->second);
+            uint64_t hash = hash_bytes(value);
+            attrs.push_back((static_cast<uint64_t>(attrId(lower_name, it->first)) << 32) | static_cast<uint32_t>(hash ^ (hash >> 32)));
+        }
+        std::sort(attrs.begin(), attrs.end());
+    }
+
+    void diff(const std::vector<uint64_t> &before, const std::vector<uint64_t> &after, list &changed)
+    {
+        std::vector<uint64_t>::const_iterator old_it = before.begin(), new_it = after.begin();
+        while ((old_it != before.end()) || (new_it != after.end()))
+        {
+            uint32_t old_id = (old_it != before.end()) ? (*old_it >> 32) : std::numeric_limits<uint32_t>::max();
+            uint32_t new_id = (new_it != after.end()) ? (*new_it >> 32) : std::numeric_limits<uint32_t>::max();
+            uint32_t id = std::min(old_id, new_id);
+            if ((old_id != new_id) || (*old_it != *new_it))
+                changed.append(m_attr_names[id]);
+            if (old_id == id) old_it++;
+            if (new_id == id) new_it++;
+        }
+    }
+
+    CollectorList *m_collectors;
+    AdTypes m_ad_type;
+    std::string m_constraint;
+    std::vector<std::string> m_attrs;
+    std::set<std::string> m_ignored;
+    std::map<std::string, uint32_t> m_attr_ids;
+    std::vector<std::string> m_attr_names;
+    boost::unordered_map<std::string, Entry> m_ads;
+    unsigned m_generation;
+};
+
 struct Collector {
 
     Collector(const std::string &pool="")
-      : m_collectors(NULL)
+      : m_collectors(NULL), m_pool(pool)
     {
+        ensure_config();
+        ModuleLock lock;
         if (pool.size())
             m_collectors = CollectorList::create(pool.c_str());
         else
@@ -51,11 +498,14 @@ struct Collector {
 
     ~Collector()
     {
+        ModuleLock lock;
         if (m_collectors) delete m_collectors;
     }
 
-    object query(AdTypes ad_type, const std::string &constraint, list attrs)
+    object query(AdTypes ad_type, const std::string &constraint, list attrs, double timeout, bool lazy)
     {
+        ModuleLock lock;
+        Deadline deadline(timeout, &m_canceller);
         CondorQuery query(ad_type);
         if (constraint.length())
         {
@@ -77,59 +527,85 @@ struct Collector {
             }
             query.setDesiredAttrs(&attrs_char[0]);
         }
-        ClassAdList adList;
 
-        QueryResult result = m_collectors->query(query, adList, NULL);
+        list retval;
+        WireLog log(WireLog::collectorKey(m_pool, ad_type, constraint, attrs_str));
+        if (lazy)
+        {
+            // Lazy results bypass the cache, which stores decoded ads.
+            std::vector<WireAd> wire_ads;
+            WireAdSink sink(wire_ads);
+            QueryResult result;
+            Py_BEGIN_ALLOW_THREADS
+            if (log.replaying())
+                result = log.replay(sink);
+            else if ((result = query_collectors(m_collectors, ad_type, query, log.wrap(sink), deadline)) == Q_OK)
+                log.commit();
+            Py_END_ALLOW_THREADS
+            deadline.check(result != Q_OK);
+            log.check();
+
+            check_query_result(result);
 
-        switch (result)
+            for (std::vector<WireAd>::iterator it = wire_ads.begin(); it != wire_ads.end(); it++)
+            {
+                retval.append(boost::shared_ptr<LazyClassAd>(new LazyClassAd(*it)));
+            }
+            return retval;
+        }
+
+        // Recording and replaying are about the wire, so they bypass the cache.
+        QueryCache cache(m_pool, ad_type, constraint, attrs_str);
+        bool use_cache = cache.enabled() && !log.active();
+        if (use_cache && cache.load(retval))
         {
-        case Q_OK:
-            break;
-        case Q_INVALID_CATEGORY:
-            PyErr_SetString(PyExc_RuntimeError, "Category not supported by query type.");
-            boost::python::throw_error_already_set();
-        case Q_MEMORY_ERROR:
-            PyErr_SetString(PyExc_MemoryError, "Memory allocation error.");
-            boost::python::throw_error_already_set();
-        case Q_PARSE_ERROR:
-            PyErr_SetString(PyExc_SyntaxError, "Query constraints could not be parsed.");
-            boost::python::throw_error_already_set();
-        case Q_COMMUNICATION_ERROR:
-            PyErr_SetString(PyExc_IOError, "Failed communication with collector.");
-            boost::python::throw_error_already_set();
-        case Q_INVALID_QUERY:
-            PyErr_SetString(PyExc_RuntimeError, "Invalid query.");
-            boost::python::throw_error_already_set();
-        case Q_NO_COLLECTOR_HOST:
-            PyErr_SetString(PyExc_RuntimeError, "Unable to determine collector host.");
-            boost::python::throw_error_already_set();
-        default:
-            PyErr_SetString(PyExc_RuntimeError, "Unknown error from collector query.");
-            boost::python::throw_error_already_set();
+            return retval;
         }
 
-        list retval;
-        ClassAd * ad;
-        adList.Open();
-        while ((ad = adList.Next()))
+        DecodePipeline pipeline(DecodePipeline::configuredThreads(), intern_query_strings());
+        std::vector<boost::shared_ptr<ClassAdWrapper> > ads;
+        QueryResult result;
+        bool decoded = false;
+        Py_BEGIN_ALLOW_THREADS
+        if (log.replaying())
+            result = log.replay(pipeline);
+        else if ((result = query_collectors(m_collectors, ad_type, query, log.wrap(pipeline), deadline)) == Q_OK)
+            log.commit();
+        if (result == Q_OK)
+            decoded = pipeline.finish(ads);
+        Py_END_ALLOW_THREADS
+        deadline.check(result != Q_OK);
+        log.check();
+
+        check_query_result(result);
+        if (!decoded)
         {
-            boost::shared_ptr<ClassAdWrapper> wrapper(new ClassAdWrapper());
-            wrapper->CopyFrom(*ad);
-            retval.append(wrapper);
+            PyErr_SetString(PyExc_IOError, "Failed to parse ads from collector.");
+            throw_error_already_set();
+        }
+
+        if (use_cache)
+        {
+            cache.store(ads);
+        }
+
+        for (std::vector<boost::shared_ptr<ClassAdWrapper> >::const_iterator it = ads.begin(); it != ads.end(); it++)
+        {
+            retval.append(*it);
         }
         return retval;
     }
 
-    object locateAll(daemon_t d_type)
+    object locateAll(daemon_t d_type, double timeout=0)
     {
         AdTypes ad_type = convert_to_ad_type(d_type);
-        return query(ad_type, "", list());
+        return query(ad_type, "", list(), timeout, false);
     }
 
-    object locate(daemon_t d_type, const std::string &name)
+    object locate(daemon_t d_type, const std::string &name, double timeout=0)
     {
         std::string constraint = ATTR_NAME " =?= \"" + name + "\"";
-        object result = query(convert_to_ad_type(d_type), constraint, list());
+        object result = query(convert_to_ad_type(d_type), constraint, list(), timeout, false);
         if (py_len(result) >= 1) {
             return result[0];
         }
@@ -140,6 +616,7 @@ struct Collector {
 
     ClassAdWrapper *locateLocal(daemon_t d_type)
     {
+        ModuleLock lock;
         Daemon my_daemon( d_type, 0, 0 );
 
         ClassAdWrapper *wrapper = new ClassAdWrapper();
@@ -205,125 +682,381 @@ struct Collector {
     }
 
 
-    // Overloads for the Collector; can't be done in boost.python and provide
-    // docstrings.
-    object query0()
+    // TODO: this has crappy error handling when there are multiple collectors.
+    void advertise(list ads, const std::string &command_str="UPDATE_AD_GENERIC", bool use_tcp=false, double timeout=0)
     {
-        return query(ANY_AD, "", list());
+        int command = getCollectorCommandNum(command_str.c_str());
+        if (command == -1)
+        {
+            PyErr_SetString(PyExc_ValueError, ("Invalid command " + command_str).c_str());
+            throw_error_already_set();
+        }
+
+        int list_len = py_len(ads);
+        if (!list_len)
+            return;
+
+        std::vector<boost::shared_ptr<ClassAd> > ad_copies;
+        ad_copies.reserve(list_len);
+        for (int i=0; i<list_len; i++)
+        {
+            ClassAdWrapper &wrapper = extract<ClassAdWrapper &>(ads[i]);
+            materialize_lazy(wrapper);
+            boost::shared_ptr<ClassAd> ad(new ClassAd());
+            ad->CopyFrom(wrapper);
+            ad_copies.push_back(ad);
+        }
+
+        ModuleLock lock;
+        Deadline deadline(timeout, &m_canceller);
+        std::string error;
+        Py_BEGIN_ALLOW_THREADS
+        error = send_ads(m_collectors, command, use_tcp, ad_copies, &deadline);
+        Py_END_ALLOW_THREADS
+        deadline.check(error.size() > 0);
+        if (error.size())
+        {
+            PyErr_SetString(PyExc_ValueError, error.c_str());
+            throw_error_already_set();
+        }
     }
-    object query1(AdTypes ad_type)
+
+    CollectorWatch *watch(AdTypes ad_type, const std::string &constraint="", list attrs=list(), list ignore=list())
     {
-        return query(ad_type, "", list());
+        return new CollectorWatch(m_pool, ad_type, constraint, attrs, ignore);
     }
-    object query2(AdTypes ad_type, const std::string &constraint)
+
+    void cancel()
     {
-        return query(ad_type, constraint, list());
+        m_canceller.cancel();
     }
 
-    // TODO: this has crappy error handling when there are multiple collectors.
-    void advertise(list ads, const std::string &command_str="UPDATE_AD_GENERIC", bool use_tcp=false)
-    {
-        m_collectors->rewind();
-        Daemon *collector;
-        std::auto_ptr<Sock> sock;
+private:
 
-        int command = getCollectorCommandNum(command_str.c_str());
-        if (command == -1)
+    CollectorList *m_collectors;
+    std::string m_pool;
+    Canceller m_canceller;
+
+};
+
+/*
+ * Keeps a set of ads advertised from a background thread.
+ *
+ * Ads whose contents changed are sent after a short coalescing delay;
+ * unchanged ads are only re-sent often enough to keep them from expiring
+ * in the collector.  The thread never takes the GIL.
+ */
+struct Advertiser
+{
+    Advertiser(const std::string &pool="", const std::string &command_str="UPDATE_AD_GENERIC", bool use_tcp=true, double coalesce=1.0)
+      : m_collectors(NULL), m_use_tcp(use_tcp), m_coalesce(coalesce), m_stop(false), m_updates_sent(0)
+    {
+        ensure_config();
+        m_command = getCollectorCommandNum(command_str.c_str());
+        if (m_command == -1)
         {
             PyErr_SetString(PyExc_ValueError, ("Invalid command " + command_str).c_str());
             throw_error_already_set();
         }
-
-        if (command == UPDATE_STARTD_AD_WITH_ACK)
         {
-            PyErr_SetString(PyExc_NotImplementedError, "Startd-with-ack protocol is not implemented at this time.");
+            ModuleLock lock;
+            m_collectors = pool.size() ? CollectorList::create(pool.c_str()) : CollectorList::create();
+            m_default_lifetime = param_integer("CLASSAD_LIFETIME", 900);
         }
+        m_thread = boost::thread(boost::bind(&Advertiser::run, this));
+    }
 
-        int list_len = py_len(ads);
-        if (!list_len)
-            return;
+    ~Advertiser()
+    {
+        stop();
+        ModuleLock lock;
+        delete m_collectors;
+    }
 
-        compat_classad::ClassAd ad;
-        while (m_collectors->next(collector))
+    void update(list ads)
+    {
+        int list_len = py_len(ads);
+        double now = now_seconds();
+        for (int i=0; i<list_len; i++)
         {
-            if(!collector->locate()) {
-                PyErr_SetString(PyExc_ValueError, "Unable to locate collector.");
+            ClassAdWrapper &wrapper = extract<ClassAdWrapper &>(ads[i]);
+            materialize_lazy(wrapper);
+            std::string name;
+            if (!wrapper.EvaluateAttrString(ATTR_NAME, name))
+            {
+                PyErr_SetString(PyExc_ValueError, "Advertised ads must have a Name attribute.");
                 throw_error_already_set();
             }
-            int list_len = py_len(ads);
-            sock.reset();
-            for (int i=0; i<list_len; i++)
+            std::string my_type, address;
+            wrapper.EvaluateAttrString(ATTR_MY_TYPE, my_type);
+            wrapper.EvaluateAttrString(ATTR_MY_ADDRESS, address);
+            int lifetime;
+            if (!wrapper.EvaluateAttrInt(ATTR_CLASSAD_LIFETIME, lifetime) || (lifetime <= 0))
+                lifetime = m_default_lifetime;
+            std::string encoded;
+            serialize_ad(wrapper, encoded);
+            uint64_t hash = hash_bytes(encoded);
+
+            boost::mutex::scoped_lock lock(m_mutex);
+            Entry &entry = m_ads[ad_key(my_type, name, address)];
+            entry.name = name;
+            entry.my_type = my_type;
+            // Two missed refreshes still arrive before the collector expires the ad.
+            entry.refresh = lifetime / 3.0;
+            if (entry.ad.get() && (entry.hash == hash))
+                continue;
+            entry.ad.reset(new ClassAd());
+            entry.ad->CopyFrom(wrapper);
+            entry.hash = hash;
+            if (!entry.dirty)
             {
-                ClassAdWrapper &wrapper = extract<ClassAdWrapper &>(ads[i]);
-                ad.CopyFrom(wrapper);
-                if (use_tcp)
+                entry.dirty = true;
+                entry.changed = now;
+            }
+        }
+        m_cond.notify_one();
+    }
+
+    void remove(const std::string &name, const std::string &my_type="")
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        for (std::map<std::string, Entry>::iterator it = m_ads.begin(); it != m_ads.end(); )
+        {
+            if ((it->second.name == name) && (my_type.empty() || (it->second.my_type == my_type)))
+                m_ads.erase(it++);
+            else
+                it++;
+        }
+    }
+
+    void stop()
+    {
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            if (m_stop)
+                return;
+            m_stop = true;
+            m_cond.notify_one();
+        }
+        Py_BEGIN_ALLOW_THREADS
+        m_thread.join();
+        Py_END_ALLOW_THREADS
+    }
+
+    long updatesSent()
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        return m_updates_sent;
+    }
+
+    std::string lastError()
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        return m_last_error;
+    }
+
+private:
+    struct Entry
+    {
+        Entry() : hash(0), dirty(false), changed(0), sent(0), refresh(300) {}
+
+        std::string name, my_type;
+        boost::shared_ptr<ClassAd> ad;
+        uint64_t hash;
+        bool dirty;
+        double changed, sent, refresh;
+    };
+
+    void run()
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        while (true)
+        {
+            double now = now_seconds();
+            double next_due = now + 60;
+            // Once any change is due, piggyback all pending changes on the same send.
+            bool send_changes = m_stop;
+            for (std::map<std::string, Entry>::const_iterator it = m_ads.begin(); it != m_ads.end(); it++)
+            {
+                if (it->second.dirty && (it->second.changed + m_coalesce <= now))
+                    send_changes = true;
+            }
+            std::vector<std::string> keys;
+            std::vector<boost::shared_ptr<ClassAd> > due;
+            for (std::map<std::string, Entry>::iterator it = m_ads.begin(); it != m_ads.end(); it++)
+            {
+                Entry &entry = it->second;
+                double due_at = entry.dirty ? entry.changed + m_coalesce : entry.sent + entry.refresh;
+                if ((entry.dirty && send_changes) || (due_at <= now))
                 {
-                    if (!sock.get())
-                        sock.reset(collector->startCommand(command,Stream::reli_sock,20));
-                    else
-                    {
-                        sock->encode();
-                        sock->put(command);
-                    }
+                    keys.push_back(it->first);
+                    due.push_back(entry.ad);
+                    entry.dirty = false;
+                    entry.sent = now;
                 }
                 else
                 {
-                    sock.reset(collector->startCommand(command,Stream::safe_sock,20));
+                    next_due = std::min(next_due, due_at);
+                }
+            }
+
+            if (due.size())
+            {
+                bool final_pass = m_stop;
+                lock.unlock();
+                std::string error;
+                {
+                    boost::recursive_mutex::scoped_lock condor_lock(ModuleLock::mutex());
+                    error = send_ads(m_collectors, m_command, m_use_tcp, due);
                 }
-                int result = 0;
-                if (sock.get()) {
-                    result += ad.put(*sock);
-                    result += sock->end_of_message();
+                lock.lock();
+                m_last_error = error;
+                if (final_pass)
+                    break;
+                if (error.empty())
+                {
+                    m_updates_sent += due.size();
+                    continue;
                 }
-                if (result != 2) {
-                    PyErr_SetString(PyExc_ValueError, "Failed to advertise to collector");
-                    throw_error_already_set();
+                // Retry failed ads, unless they were replaced in the meantime.
+                for (size_t idx=0; idx<keys.size(); idx++)
+                {
+                    std::map<std::string, Entry>::iterator it = m_ads.find(keys[idx]);
+                    if ((it != m_ads.end()) && (it->second.ad == due[idx]) && !it->second.dirty)
+                    {
+                        it->second.dirty = true;
+                        it->second.changed = now + ADVERTISER_RETRY_DELAY;
+                    }
                 }
+                continue;
             }
-            sock->encode();
-            sock->put(DC_NOP);
-            sock->end_of_message();
+            if (m_stop)
+                break;
+
+            m_cond.timed_wait(lock, boost::get_system_time() + boost::posix_time::milliseconds(static_cast<long>((next_due - now)*1000) + 1));
         }
     }
 
-private:
-
     CollectorList *m_collectors;
+    int m_command;
+    bool m_use_tcp;
+    double m_coalesce;
+    int m_default_lifetime;
 
+    boost::mutex m_mutex;
+    boost::condition_variable m_cond;
+    boost::thread m_thread;
+    bool m_stop;
+    std::map<std::string, Entry> m_ads;
+    long m_updates_sent;
+    std::string m_last_error;
 };
 
-BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(advertise_overloads, advertise, 1, 3);
+static dict
+hedge_stats_dict()
+{
+    unsigned long started, won;
+    {
+        ModuleLock lock;
+        hedge_stats(started, won);
+    }
+    dict result;
+    result["Triggered"] = started;
+    result["Won"] = won;
+    return result;
+}
+
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(advertise_overloads, advertise, 1, 4);
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(locate_overloads, locate, 2, 3);
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(locate_all_overloads, locateAll, 1, 2);
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(watch_overloads, watch, 1, 4);
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(poll_overloads, poll, 0, 1);
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(remove_overloads, remove, 1, 2);
 
 void export_collector()
 {
-    class_<Collector>("Collector", "Client-side operations for the HTCondor collector")
+    def("hedgeStats", hedge_stats_dict,
+        "Statistics on hedged collector queries (see PYTHON_COLLECTOR_HEDGE) made by this process.\n"
+        ":return: A dictionary with Triggered, the number of queries also sent to a backup collector, "
+        "and Won, the number of those answered first by the backup.");
+
+    class_<Collector, boost::noncopyable>("Collector", "Client-side operations for the HTCondor collector")
         .def(init<std::string>(":param pool: Name of collector to query; if not specified, uses the local one."))
-        .def("query", &Collector::query0)
-        .def("query", &Collector::query1)
-        .def("query", &Collector::query2)
         .def("query", &Collector::query,
+            (arg("ad_type")=ANY_AD, arg("constraint")="", arg("attrs")=list(), arg("timeout")=0.0, arg("lazy")=false),
             "Query the contents of a collector.\n"
             ":param ad_type: Type of ad to return from the AdTypes enum; if not specified, uses ANY_AD.\n"
             ":param constraint: A constraint for the ad query; defaults to true.\n"
             ":param attrs: A list of attributes; if specified, the returned ads will be "
             "projected along these attributes.\n"
+            ":param timeout: Seconds allowed for the whole query; if not specified, there is no limit.\n"
+            ":param lazy: When set to true, each returned ad decodes an attribute only when it is first accessed; "
+            "worthwhile when only a few attributes of each ad are read.  Lazy queries are never cached.\n"
             ":return: A list of ads in the collector matching the constraint.")
         .def("locate", &Collector::locateLocal, return_value_policy<manage_new_object>())
-        .def("locate", &Collector::locate,
+        .def("locate", &Collector::locate, locate_overloads(args("daemon_type", "name", "timeout"),
             "Query the collector for a particular daemon.\n"
             ":param daemon_type: Type of daemon; must be from the DaemonTypes enum.\n"
             ":param name: Name of daemon to locate.  If not specified, it searches for the local daemon.\n"
-            ":return: The ad of the corresponding daemon.")
-        .def("locateAll", &Collector::locateAll,
+            ":param timeout: Seconds allowed for the query; if not specified, there is no limit.\n"
+            ":return: The ad of the corresponding daemon."))
+        .def("locateAll", &Collector::locateAll, locate_all_overloads(args("daemon_type", "timeout"),
             "Query the collector for all ads of a particular type.\n"
             ":param daemon_type: Type of daemon; must be from the DaemonTypes enum.\n"
-            ":return: A list of matching ads.")
-        .def("advertise", &Collector::advertise, advertise_overloads(
+            ":param timeout: Seconds allowed for the query; if not specified, there is no limit.\n"
+            ":return: A list of matching ads."))
+        .def("advertise", &Collector::advertise, advertise_overloads(args("ad_list", "command", "use_tcp", "timeout"),
             "Advertise a list of ClassAds into the collector.\n"
             ":param ad_list: A list of ClassAds.\n"
             ":param command: A command for the collector; defaults to UPDATE_AD_GENERIC;"
             " other commands, such as UPDATE_STARTD_AD, may require reduced authorization levels.\n"
-            ":param use_tcp: When set to true, updates are sent via TCP."))
+            " With UPDATE_STARTD_AD_WITH_ACK, the call returns once the collector has acknowledged every ad;"
+            " each ad is sent with a private ad holding its Name, Machine, MyAddress, StartdIpAddr and Capability.\n"
+            ":param use_tcp: When set to true, updates are sent via TCP; UPDATE_STARTD_AD_WITH_ACK always uses TCP.\n"
+            ":param timeout: Seconds allowed for the whole update; if not specified, each send may take up to 20 seconds."))
+        .def("watch", &Collector::watch, watch_overloads(args("ad_type", "constraint", "attrs", "ignore"),
+            "Watch the results of a query, reporting only what changed between polls.\n"
+            ":param ad_type: Type of ad to watch from the AdTypes enum.\n"
+            ":param constraint: A constraint for the ad query; defaults to true.\n"
+            ":param attrs: A list of attributes to project along; defaults to all attributes.\n"
+            ":param ignore: Attributes whose changes are not reported, in addition to LastHeardFrom, "
+            "UpdateSequenceNumber and the other per-update statistics.\n"
+            ":return: A CollectorWatch object.")[return_value_policy<manage_new_object>()])
+        .def("cancel", &Collector::cancel,
+            "Cancel the query or advertise in progress on this object, from another thread.\n"
+            "The interrupted call raises IOError and returns no partial results.")
+        ;
+
+    enum_<AdChange>("AdChange")
+        .value("Added", AD_ADDED)
+        .value("Removed", AD_REMOVED)
+        .value("Changed", AD_CHANGED)
+        ;
+
+    class_<CollectorWatch, boost::noncopyable>("CollectorWatch", "The changing results of a collector query; create with Collector.watch.", no_init)
+        .def("poll", &CollectorWatch::poll, poll_overloads(args("timeout"),
+            "Query the collector and compare the result with the previous poll.\n"
+            ":param timeout: Seconds allowed for the query; if not specified, there is no limit.\n"
+            ":return: A list of (AdChange, ad, changed attribute names) tuples.  The first poll reports every ad as Added; "
+            "ads are matched by MyType, Name and MyAddress, and removed ads only carry those attributes."))
+        .def("__len__", &CollectorWatch::size, "Number of ads seen in the last poll.")
+        ;
+
+    class_<Advertiser, boost::noncopyable>("Advertiser", "Keeps a set of ClassAds advertised in the collector from a background thread.\n"
+            "Changed ads are sent promptly; unchanged ads are re-sent only as often as needed to keep them from expiring.",
+            init<optional<std::string, std::string, bool, double> >(
+            ":param pool: Name of collector to advertise to; if not specified, uses the local one.\n"
+            ":param command: A command for the collector; defaults to UPDATE_AD_GENERIC.\n"
+            ":param use_tcp: When set to true (the default), updates are sent via TCP.\n"
+            ":param coalesce: Seconds to wait after a change before sending, so bursts of changes go out together; defaults to 1."))
+        .def("update", &Advertiser::update, "Add ads to the advertised set, or replace ads with the same MyType, Name and MyAddress.\n"
+            ":param ad_list: A list of ClassAds.  Ads identical to the ones already registered are ignored.")
+        .def("remove", &Advertiser::remove, remove_overloads(args("name", "my_type"), "Stop advertising an ad; the collector will expire it.\n"
+            ":param name: The Name of the ad.\n"
+            ":param my_type: The MyType of the ad; if not specified, every advertised ad with that Name is removed."))
+        .def("stop", &Advertiser::stop, "Send any pending changes and stop the background thread.")
+        .add_property("updatesSent", &Advertiser::updatesSent, "Number of ads sent to the collector so far.")
+        .add_property("lastError", &Advertiser::lastError, "Error from the most recent update attempt; empty if it succeeded.")
         ;
 }
 
@@ -0,0 +1,441 @@
+
+#include "condor_attributes.h"
+#include "condor_commands.h"
+#include "condor_config.h"
+#include "reli_sock.h"
+
+#include <ctype.h>
+#include <math.h>
+#include <string.h>
+
+#include <memory>
+#include <algorithm>
+#include <boost/noncopyable.hpp>
+
+#include "collector_query.h"
+#include "timing.h"
+
+static int
+query_command(AdTypes ad_type)
+{
+    switch (ad_type)
+    {
+    case STARTD_AD: return QUERY_STARTD_ADS;
+    case STARTD_PVT_AD: return QUERY_STARTD_PVT_ADS;
+    case SCHEDD_AD: return QUERY_SCHEDD_ADS;
+    case SUBMITTOR_AD: return QUERY_SUBMITTOR_ADS;
+    case MASTER_AD: return QUERY_MASTER_ADS;
+    case CKPT_SRVR_AD: return QUERY_CKPT_SRVR_ADS;
+    case COLLECTOR_AD: return QUERY_COLLECTOR_ADS;
+    case LICENSE_AD: return QUERY_LICENSE_ADS;
+    case STORAGE_AD: return QUERY_STORAGE_ADS;
+    case NEGOTIATOR_AD: return QUERY_NEGOTIATOR_ADS;
+    case HAD_AD: return QUERY_HAD_ADS;
+    case GENERIC_AD: return QUERY_GENERIC_ADS;
+    case XFER_SERVICE_AD: return QUERY_XFER_SERVICE_ADS;
+    case LEASE_MANAGER_AD: return QUERY_LEASE_MANAGER_ADS;
+    case GRID_AD: return QUERY_GRID_ADS;
+    case DEFRAG_AD: return QUERY_DEFRAG_ADS;
+    case ACCOUNTING_AD: return QUERY_ACCOUNTING_ADS;
+    case ANY_AD: return QUERY_ANY_ADS;
+    default: return -1;
+    }
+}
+
+// Marks a line sent with put_secret; as in classad_oldnew.cpp.
+#define SECRET_MARKER "ZKM"
+
+bool
+get_wire_ad(Stream *sock, WireAd &ad)
+{
+    int count;
+    if (!sock->code(count))
+        return false;
+    ad.text.clear();
+    for (int idx=0; idx<count; idx++)
+    {
+        const char *line = NULL;
+        if (!sock->get_string_ptr(line) || !line)
+            return false;
+        if (!strcmp(line, SECRET_MARKER))
+        {
+            char *secret = NULL;
+            if (!sock->get_secret(secret) || !secret)
+                return false;
+            ad.text += secret;
+            free(secret);
+        }
+        else
+            ad.text += line;
+        ad.text += '\0';
+    }
+    if (!sock->get(ad.my_type) || !sock->get(ad.target_type))
+        return false;
+    if (ad.my_type == "(unknown type)")
+        ad.my_type.clear();
+    if (ad.target_type == "(unknown type)")
+        ad.target_type.clear();
+    return true;
+}
+
+static classad::ExprTree *
+parse_wire_attr(classad::ClassAdParser &parser, const char *line, std::string &name)
+{
+    const char *equals = strchr(line, '=');
+    if (!equals)
+        return NULL;
+    const char *start = line;
+    while (isspace(*start))
+        start++;
+    const char *end = equals;
+    while ((end > start) && isspace(end[-1]))
+        end--;
+    if (end == start)
+        return NULL;
+    name.assign(start, end - start);
+    // Old ClassAds escape strings differently.
+    std::string rhs;
+    compat_classad::ConvertEscapingOldToNew(equals + 1, rhs);
+    classad::ExprTree *expr = NULL;
+    if (!parser.ParseExpression(rhs, expr, true))
+        return NULL;
+    return expr;
+}
+
+classad::ExprTree *
+parse_wire_attr(const char *line, std::string &name)
+{
+    classad::ClassAdParser parser;
+    return parse_wire_attr(parser, line, name);
+}
+
+bool
+parse_wire_ad(const WireAd &wire, classad::ClassAd &ad)
+{
+    classad::ClassAdParser parser;
+    std::string name;
+    const char *line = wire.text.c_str();
+    const char *end = line + wire.text.size();
+    while (line < end)
+    {
+        classad::ExprTree *expr = parse_wire_attr(parser, line, name);
+        // Not through the expression cache, which is shared by all threads.
+        if (!expr || !ad.Insert(name, expr, false))
+            return false;
+        line += strlen(line) + 1;
+    }
+    if (wire.my_type.size())
+        ad.InsertAttr(ATTR_MY_TYPE, wire.my_type);
+    if (wire.target_type.size())
+        ad.InsertAttr(ATTR_TARGET_TYPE, wire.target_type);
+    return true;
+}
+
+void
+prepare_wire_parsing()
+{
+    static bool prepared = false;
+    if (prepared)
+        return;
+    // The first compat ClassAd registers HTCondor's functions, and the first
+    // function call parsed builds the function table.
+    compat_classad::ClassAd ad;
+    classad::ClassAdParser parser;
+    delete parser.ParseExpression("isUndefined(x)");
+    prepared = true;
+}
+
+bool
+QuerySink::read(Stream *sock)
+{
+    WireAd ad;
+    return get_wire_ad(sock, ad) && put(ad);
+}
+
+bool
+ParsedAdSink::read(Stream *sock)
+{
+    boost::shared_ptr<ClassAd> ad(new ClassAd());
+    if (!getClassAd(sock, *ad))
+        return false;
+    m_ads.push_back(ad);
+    return true;
+}
+
+bool
+ParsedAdSink::put(WireAd &wire)
+{
+    boost::shared_ptr<ClassAd> ad(new ClassAd());
+    if (!parse_wire_ad(wire, *ad))
+        return false;
+    m_ads.push_back(ad);
+    return true;
+}
+
+bool
+WireAdSink::put(WireAd &ad)
+{
+    m_ads.push_back(WireAd());
+    m_ads.back().swap(ad);
+    return true;
+}
+
+// One query sent to one collector, whose response is read an ad at a time.
+class CollectorRequest : boost::noncopyable
+{
+public:
+    CollectorRequest(Deadline &deadline, QuerySink &sink)
+      : m_deadline(deadline), m_sink(sink), m_attached(false), m_done(false)
+    {}
+
+    // Keeps cancel() away from the descriptor once the socket is closed.
+    ~CollectorRequest()
+    {
+        if (m_attached)
+            m_deadline.detach();
+    }
+
+    // Connect and send the query; with attach, cancel() shuts the socket down.
+    bool start(Daemon *collector, int command, ClassAd &query_ad, int default_timeout, bool attach)
+    {
+        m_sock.reset(new ReliSock());
+        if (!collector->connectSock(m_sock.get(), m_deadline.remaining(default_timeout)))
+            return false;
+        // Attach before the security handshake, so cancel() can interrupt it.
+        if (attach)
+        {
+            m_deadline.attach(fd());
+            m_attached = true;
+        }
+        if (!collector->startCommand(command, m_sock.get(), m_deadline.remaining(default_timeout)))
+            return false;
+        if (!putClassAd(m_sock.get(), query_ad) || !m_sock->end_of_message())
+            return false;
+        m_sock->decode();
+        return true;
+    }
+
+    int fd() { return m_sock->get_file_desc(); }
+    bool readReady() { return m_sock->readReady(); }
+    bool done() const { return m_done; }
+
+    // Read the next ad, or the end of the response; false on error.  A
+    // positive max_wait caps the wait for the ad; a read cut short leaves
+    // the socket unusable, so the request is then failed for good.
+    bool readNext(int default_timeout, int max_wait=0)
+    {
+        int more = 1;
+        int timeout = m_deadline.remaining(default_timeout);
+        if ((max_wait > 0) && ((timeout <= 0) || (max_wait < timeout)))
+            timeout = max_wait;
+        m_sock->timeout(timeout);
+        if (!m_sock->code(more))
+            return false;
+        if (!more)
+        {
+            m_sock->end_of_message();
+            m_done = true;
+            return true;
+        }
+        return m_sink.read(m_sock.get());
+    }
+
+    bool readAll(int default_timeout)
+    {
+        while (!m_done)
+        {
+            if (m_deadline.poll() || !readNext(default_timeout))
+                return false;
+        }
+        return true;
+    }
+
+private:
+    Deadline &m_deadline;
+    QuerySink &m_sink;
+    std::auto_ptr<Sock> m_sock;
+    bool m_attached;
+    bool m_done;
+};
+
+/*
+ * Hedging state, shared by all the collector queries of the process and
+ * protected by the module lock.  The delay before hedging is a percentile
+ * of the time recent queries waited for the first byte of their response.
+ */
+#define HEDGE_SAMPLES 128
+#define HEDGE_MIN_SAMPLES 16
+#define HEDGE_INITIAL_DELAY 1.0
+
+static std::vector<double> g_first_response_times;
+static size_t g_next_sample = 0;
+static unsigned long g_hedges_started = 0;
+static unsigned long g_hedges_won = 0;
+
+static void
+record_first_response(double seconds)
+{
+    if (g_first_response_times.size() < HEDGE_SAMPLES)
+        g_first_response_times.push_back(seconds);
+    else
+        g_first_response_times[g_next_sample++ % HEDGE_SAMPLES] = seconds;
+}
+
+static double
+hedge_delay()
+{
+    double min_delay = param_double("PYTHON_COLLECTOR_HEDGE_MIN_DELAY", 0.1, 0);
+    if (g_first_response_times.size() < HEDGE_MIN_SAMPLES)
+        return std::max(min_delay, HEDGE_INITIAL_DELAY);
+    int percentile = param_integer("PYTHON_COLLECTOR_HEDGE_PERCENTILE", 95, 1, 100);
+    std::vector<double> times(g_first_response_times);
+    size_t idx = (times.size() - 1) * percentile / 100;
+    std::nth_element(times.begin(), times.begin() + idx, times.end());
+    return std::max(min_delay, times[idx]);
+}
+
+void
+hedge_stats(unsigned long &started, unsigned long &won)
+{
+    started = g_hedges_started;
+    won = g_hedges_won;
+}
+
+// Query primary.  If backup is given and primary has not started answering
+// after the hedging delay, or stalls that long in the middle of its answer,
+// send the same query to backup too, and keep the first complete response;
+// the other request is abandoned.
+static bool
+query_one(Daemon *primary, Daemon *backup, int command, ClassAd &query_ad, int default_timeout,
+    QuerySink &sink, Deadline &deadline, bool &hedged)
+{
+    hedged = false;
+    CollectorRequest first(deadline, sink);
+    double start = now_seconds();
+    if (!first.start(primary, command, query_ad, default_timeout, true))
+        return false;
+    // Nothing is buffered in the socket until the collector starts its
+    // reply, so these waits can safely poll the descriptor directly.
+    std::vector<int> fds(1, first.fd());
+    if (!backup)
+        return (deadline.waitReadable(fds) == 0) && first.readAll(default_timeout);
+
+    double delay = hedge_delay();
+    // Socket timeouts are whole seconds.
+    int stall = std::max(1, static_cast<int>(ceil(delay)));
+    bool first_ok = true, first_answered = false;
+    if (deadline.waitReadable(fds, delay) == 0)
+    {
+        record_first_response(now_seconds() - start);
+        first_answered = true;
+        // Once answering, any gap of the hedging delay hedges as well:
+        // between ads by waiting no longer, within one by giving up on it.
+        while (!deadline.poll())
+        {
+            if (!first.readReady() && (deadline.waitReadable(fds, delay) != 0))
+                break;
+            first_ok = first.readNext(default_timeout, stall);
+            if (!first_ok)
+                break;
+            if (first.done())
+                return true;
+        }
+    }
+    if (deadline.poll())
+        return false;
+
+    hedged = true;
+    g_hedges_started++;
+    std::vector<WireAd> backup_ads;
+    WireAdSink backup_sink(backup_ads);
+    CollectorRequest second(deadline, backup_sink);
+    bool second_ok = backup->locate() && second.start(backup, command, query_ad, default_timeout, false);
+    while ((first_ok || second_ok) && !deadline.poll())
+    {
+        // Take one ad from each response with data, so neither holds up the
+        // other; a read stalling past the hedging delay drops its request.
+        bool progressed = false;
+        if (first_ok && first.readReady())
+        {
+            if (!first_answered)
+            {
+                record_first_response(now_seconds() - start);
+                first_answered = true;
+            }
+            progressed = true;
+            first_ok = first.readNext(default_timeout, stall);
+            if (first_ok && first.done())
+                return true;
+        }
+        if (second_ok && second.readReady())
+        {
+            progressed = true;
+            second_ok = second.readNext(default_timeout, stall);
+            if (second_ok && second.done())
+            {
+                g_hedges_won++;
+                sink.clear();
+                for (std::vector<WireAd>::iterator it = backup_ads.begin(); it != backup_ads.end(); it++)
+                {
+                    if (!sink.put(*it))
+                        return false;
+                }
+                return true;
+            }
+        }
+        if (!progressed)
+        {
+            fds.clear();
+            if (first_ok)
+                fds.push_back(first.fd());
+            if (second_ok)
+                fds.push_back(second.fd());
+            deadline.waitReadable(fds);
+        }
+    }
+    return false;
+}
+
+QueryResult
+query_collectors(CollectorList *collectors, AdTypes ad_type, CondorQuery &query,
+    QuerySink &sink, Deadline &deadline)
+{
+    int command = query_command(ad_type);
+    if (command == -1)
+        return Q_INVALID_CATEGORY;
+    ClassAd query_ad;
+    QueryResult result = query.getQueryAd(query_ad);
+    if (result != Q_OK)
+        return result;
+    if (!collectors->number())
+        return Q_NO_COLLECTOR_HOST;
+
+    int default_timeout = param_integer("QUERY_TIMEOUT", 60);
+    bool hedging = param_boolean("PYTHON_COLLECTOR_HEDGE", false);
+    std::vector<Daemon *> daemons;
+    collectors->rewind();
+    Daemon *collector;
+    while (collectors->next(collector))
+        daemons.push_back(collector);
+    for (size_t idx=0; (idx<daemons.size()) && !deadline.poll(); idx++)
+    {
+        sink.clear();
+        Daemon *backup = (hedging && (idx+1 < daemons.size())) ? daemons[idx+1] : NULL;
+        bool hedged = false;
+        if (daemons[idx]->locate() && query_one(daemons[idx], backup, command, query_ad, default_timeout, sink, deadline, hedged))
+            return Q_OK;
+        // A hedged query has already failed on the backup too.
+        if (hedged)
+            idx++;
+    }
+    sink.clear();
+    return Q_COMMUNICATION_ERROR;
+}
+
+QueryResult
+query_collectors(CollectorList *collectors, AdTypes ad_type, CondorQuery &query,
+    std::vector<boost::shared_ptr<ClassAd> > &ads, Deadline &deadline)
+{
+    ParsedAdSink sink(ads);
+    return query_collectors(collectors, ad_type, query, sink, deadline);
+}
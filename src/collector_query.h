@@ -0,0 +1,118 @@
+
+#ifndef __COLLECTOR_QUERY_H_
+#define __COLLECTOR_QUERY_H_
+
+#include "condor_adtypes.h"
+#include "dc_collector.h"
+
+#include <string>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+
+#include "deadline.h"
+
+/*
+ * An ad as sent on the wire, before parsing: its attributes as "Name = expr"
+ * lines in the old ClassAd syntax, each terminated by a NUL, then its types.
+ */
+struct WireAd
+{
+    void swap(WireAd &other)
+    {
+        text.swap(other.text);
+        my_type.swap(other.my_type);
+        target_type.swap(other.target_type);
+    }
+
+    std::string text;
+    std::string my_type;
+    std::string target_type;
+};
+
+// The counterpart of getClassAd, leaving the attributes unparsed.
+bool get_wire_ad(Stream *sock, WireAd &ad);
+
+/*
+ * Parse an ad read by get_wire_ad, as getClassAd would have, or one of its
+ * "Name = expr" lines (NULL on a syntax error).
+ *
+ * Unlike getClassAd, these may run on any thread without the module lock:
+ * they use a private classad::ClassAdParser per call, whose lexer keeps
+ * all its state in the parser; they bypass the process-wide expression
+ * cache; and besides the ClassAd library they only call
+ * ConvertEscapingOldToNew, a plain string transformation.  The ClassAd
+ * function table, filled the first time it is used, must have been set up
+ * by prepare_wire_parsing() first.
+ */
+bool parse_wire_ad(const WireAd &wire, classad::ClassAd &ad);
+classad::ExprTree *parse_wire_attr(const char *line, std::string &name);
+
+// Initialize the ClassAd library's shared tables, including the functions
+// HTCondor adds to it.  Call with the module lock held.
+void prepare_wire_parsing();
+
+/*
+ * Receives the ads of a query response as they are read off the socket,
+ * or replayed from a recording.
+ */
+class QuerySink
+{
+public:
+    virtual ~QuerySink() {}
+
+    // Read the next ad from sock; false on a protocol error.
+    virtual bool read(Stream *sock);
+
+    // Take the next ad, already framed; the sink may swap out its contents.
+    virtual bool put(WireAd &ad) = 0;
+
+    // Drop the ads read so far, before failing over to another collector.
+    virtual void clear() = 0;
+};
+
+class ParsedAdSink : public QuerySink
+{
+public:
+    ParsedAdSink(std::vector<boost::shared_ptr<ClassAd> > &ads) : m_ads(ads) {}
+
+    bool read(Stream *sock);
+    bool put(WireAd &ad);
+    void clear() { m_ads.clear(); }
+
+private:
+    std::vector<boost::shared_ptr<ClassAd> > &m_ads;
+};
+
+class WireAdSink : public QuerySink
+{
+public:
+    WireAdSink(std::vector<WireAd> &ads) : m_ads(ads) {}
+
+    bool put(WireAd &ad);
+    void clear() { m_ads.clear(); }
+
+private:
+    std::vector<WireAd> &m_ads;
+};
+
+/*
+ * Query the collectors of a pool, failing over like CollectorList::query,
+ * but reading the response one ad at a time so the call can stop when its
+ * deadline passes or it is cancelled.  On failure, the sink is left empty.
+ *
+ * With PYTHON_COLLECTOR_HEDGE, a collector slow to start answering gets
+ * the same query sent to the next one as well; see query_one.
+ *
+ * Must be called with the module lock held and the GIL released.
+ */
+QueryResult query_collectors(CollectorList *collectors, AdTypes ad_type, CondorQuery &query,
+    QuerySink &sink, Deadline &deadline);
+
+QueryResult query_collectors(CollectorList *collectors, AdTypes ad_type, CondorQuery &query,
+    std::vector<boost::shared_ptr<ClassAd> > &ads, Deadline &deadline);
+
+// Queries sent to a second collector, and how many of those it answered
+// first.  Call with the module lock held.
+void hedge_stats(unsigned long &started, unsigned long &won);
+
+#endif
@@ -17,9 +17,11 @@ BOOST_PYTHON_MODULE(condor)
     //docstring_options local_docstring_options(true, false, false);
 
     export_config();
+    export_lazy_ad();
     export_daemon_and_ad_types();
     export_collector();
     export_schedd();
     export_dc_tool();
     export_secman();
+    export_match_analysis();
 }
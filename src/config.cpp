@@ -1,16 +1,68 @@
 
 #include "condor_common.h"
 #include "condor_config.h"
+#include "condor_environ.h"
 #include "condor_version.h"
 
+#include <stdlib.h>
+#include <string.h>
+
 #include <boost/python.hpp>
 
+#include "module_lock.h"
+#include "lazy_config.h"
+
 using namespace boost::python;
 
+// Set once the configuration is loaded; protected by the module lock.
+static bool g_config_loaded = false;
+
+#define ENV_CONFIG_PREFIX "_condor_"
+
+static bool
+minimal_config()
+{
+    const char *minimal = getenv(ENV_CONFIG_PREFIX "PYTHON_MINIMAL_CONFIG");
+    return minimal && (!strcasecmp(minimal, "true") || !strcasecmp(minimal, "yes") || !strcmp(minimal, "1"));
+}
+
+// Run config() with CONDOR_CONFIG=ONLY_ENV, so the configuration files are
+// skipped but the defaults, the special macros (FULL_HOSTNAME, IP_ADDRESS,
+// ...), the _condor_ environment settings and the network setup are all
+// done as usual.  The caller's CONDOR_CONFIG is restored afterward.
+static void
+minimal_config_load()
+{
+    const char *env_name = EnvGetName(ENV_CONFIG);
+    const char *saved = getenv(env_name);
+    std::string saved_value = saved ? saved : "";
+    setenv(env_name, "ONLY_ENV", 1);
+    config();
+    if (saved)
+        setenv(env_name, saved_value.c_str(), 1);
+    else
+        unsetenv(env_name);
+}
+
+void
+ensure_config()
+{
+    ModuleLock lock;
+    if (g_config_loaded)
+        return;
+    if (minimal_config())
+        minimal_config_load();
+    else
+        config();
+    g_config_loaded = true;
+}
+
 struct Param
 {
     std::string getitem(const std::string &attr)
     {
+        ensure_config();
+        ModuleLock lock;
         std::string result;
         if (!param(result, attr.c_str()))
         {
@@ -22,11 +74,15 @@ struct Param
 
     void setitem(const std::string &attr, const std::string &val)
     {
+        ensure_config();
+        ModuleLock lock;
         param_insert(attr.c_str(), val.c_str());
     }
 
     std::string setdefault(const std::string &attr, const std::string &def)
     {
+        ensure_config();
+        ModuleLock lock;
         std::string result;
         if (!param(result, attr.c_str()))
         {
@@ -41,14 +97,21 @@ std::string CondorVersionWrapper() { return CondorVersion(); }
 
 std::string CondorPlatformWrapper() { return CondorPlatform(); }
 
-BOOST_PYTHON_FUNCTION_OVERLOADS(config_overloads, config, 0, 3);
+void reload_config(int wantsQuiet=0, bool ignore_invalid_entry=false, bool wantExtraInfo=true)
+{
+    ModuleLock lock;
+    config(wantsQuiet, ignore_invalid_entry, wantExtraInfo);
+    g_config_loaded = true;
+}
+
+BOOST_PYTHON_FUNCTION_OVERLOADS(config_overloads, reload_config, 0, 3);
 
 void export_config()
 {
-    config();
     def("version", CondorVersionWrapper, "Returns the version of HTCondor this module is linked against.");
     def("platform", CondorPlatformWrapper, "Returns the platform of HTCondor this module is running on.");
-    def("reload_config", config, config_overloads("Reload the HTCondor configuration from disk."));
+    def("reload_config", reload_config, config_overloads("Reload the HTCondor configuration from disk.  "
+        "The configuration is otherwise loaded on first use, not when the module is imported."));
     class_<Param>("_Param")
         .def("__getitem__", &Param::getitem)
         .def("__setitem__", &Param::setitem)
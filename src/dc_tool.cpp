@@ -2,6 +2,7 @@
 #include "condor_common.h"
 
 #include <boost/python.hpp>
+#include <boost/bind.hpp>
 
 #include "daemon.h"
 #include "daemon_types.h"
@@ -10,6 +11,11 @@
 #include "compat_classad.h"
 
 #include "classad_wrapper.h"
+#include "module_lock.h"
+#include "deadline.h"
+#include "forked_query.h"
+#include "lazy_ad.h"
+#include "lazy_config.h"
 
 using namespace boost::python;
 
@@ -29,8 +35,36 @@ enum DaemonCommands {
   DRESTART_PEACEFUL = RESTART_PEACEFUL
 };
 
-void send_command(const ClassAdWrapper & ad, DaemonCommands dc, const std::string &target="")
+// Runs in a worker process; see ForkedQuery.
+static std::string
+command_in_worker(ClassAd &ad, daemon_t d_type, DaemonCommands dc, const std::string &target, int timeout, AdSink &)
 {
+    Daemon d(&ad, d_type, NULL);
+    if (!d.locate())
+        return "Unable to locate daemon.";
+    ReliSock sock;
+    sock.timeout(timeout);
+    if (!sock.connect(d.addr()))
+        return "Unable to connect to the remote daemon";
+    if (!d.startCommand(dc, &sock, timeout, NULL))
+        return "Failed to start command.";
+    if (target.size())
+    {
+        std::vector<unsigned char> target_cstr(target.size()+1);
+        memcpy(&target_cstr[0], target.c_str(), target.size()+1);
+        if (!sock.code(&target_cstr[0]))
+            return "Failed to send target.";
+        if (!sock.end_of_message())
+            return "Failed to send end-of-message.";
+    }
+    sock.close();
+    return "";
+}
+
+void send_command(const ClassAdWrapper & ad, DaemonCommands dc, const std::string &target="", double timeout=0)
+{
+    ensure_config();
+    materialize_lazy(ad);
     std::string addr;
     if (!ad.EvaluateAttrString(ATTR_MY_ADDRESS, addr))
     {
@@ -61,43 +95,26 @@ void send_command(const ClassAdWrapper & ad, DaemonCommands dc, const std::strin
         throw_error_already_set();
     }
 
+    ModuleLock lock;
+    Deadline deadline(timeout);
     ClassAd ad_copy; ad_copy.CopyFrom(ad);
-    Daemon d(&ad_copy, d_type, NULL);
-    if (!d.locate())
+    // Sending blocks in the HTCondor libraries; do it in a worker process,
+    // waited for without the GIL, that the timeout or a KeyboardInterrupt
+    // can abandon.
+    ForkedQuery worker(boost::bind(command_in_worker, boost::ref(ad_copy), d_type, dc, target, deadline.remaining(), _1));
+    std::vector<boost::shared_ptr<ClassAdWrapper> > results;
+    Py_BEGIN_ALLOW_THREADS
+    while (worker.read(results) && deadline.waitReadable(worker.fd())) {}
+    Py_END_ALLOW_THREADS
+    deadline.check();
+    if (worker.error().size())
     {
-        PyErr_SetString(PyExc_RuntimeError, "Unable to locate daemon.");
+        PyErr_SetString(PyExc_RuntimeError, worker.error().c_str());
         throw_error_already_set();
     }
-    ReliSock sock;
-    if (!sock.connect(d.addr()))
-    {
-        PyErr_SetString(PyExc_RuntimeError, "Unable to connect to the remote daemon");
-        throw_error_already_set();
-    }
-    if (!d.startCommand(dc, &sock, 0, NULL))
-    {
-        PyErr_SetString(PyExc_RuntimeError, "Failed to start command.");
-        throw_error_already_set();
-    }
-    if (target.size())
-    {
-        std::vector<unsigned char> target_cstr; target_cstr.reserve(target.size()+1);
-        memcpy(&target_cstr[0], target.c_str(), target.size()+1);
-        if (!sock.code(&target_cstr[0]))
-        {
-            PyErr_SetString(PyExc_RuntimeError, "Failed to send target.");
-            throw_error_already_set();
-        }
-        if (!sock.end_of_message())
-        {
-            PyErr_SetString(PyExc_RuntimeError, "Failed to send end-of-message.");
-            throw_error_already_set();
-        }
-    }
-    sock.close();
 }
 
-BOOST_PYTHON_FUNCTION_OVERLOADS(send_command_overloads, send_command, 2, 3);
+BOOST_PYTHON_FUNCTION_OVERLOADS(send_command_overloads, send_command, 2, 4);
 
 void
 export_dc_tool()
@@ -118,10 +135,12 @@ export_dc_tool()
         .value("RestartPeacful", DRESTART_PEACEFUL)
         ;
 
-    def("send_command", send_command, send_command_overloads("Send a command to a HTCondor daemon specified by a location ClassAd\n"
+    def("send_command", send_command, send_command_overloads(args("ad", "dc", "target", "timeout"), "Send a command to a HTCondor daemon specified by a location ClassAd\n"
         ":param ad: An ad specifying the location of the daemon; typically, found by using Collector.locate(...).\n"
         ":param dc: A command type; must be a member of the enum DaemonCommands.\n"
         ":param target: Some commands require additional arguments; for example, sending DaemonOff to a master requires one to specify which subsystem to turn off."
-        "  If this parameter is given, the daemon is sent an additional argument."))
+        "  If this parameter is given, the daemon is sent an additional argument.\n"
+        ":param timeout: Seconds allowed for connecting and sending the command; if not specified, there is no limit.  "
+        "The command is sent from a worker process, which is abandoned when the time is up or on KeyboardInterrupt."))
         ;
 }
@@ -0,0 +1,185 @@
+
+#include <math.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+
+#include <boost/python.hpp>
+
+#include "deadline.h"
+#include "timing.h"
+
+// Interval, in seconds, between checks for KeyboardInterrupt.
+#define SIGNAL_CHECK_INTERVAL 0.2
+
+Canceller::Canceller()
+  : m_active(false), m_cancelled(false), m_fd(-1)
+{
+}
+
+void
+Canceller::cancel()
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    if (!m_active)
+        return;
+    m_cancelled = true;
+    if (m_fd >= 0)
+        shutdown(m_fd, SHUT_RDWR);
+}
+
+void
+Canceller::begin()
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_active = true;
+    m_cancelled = false;
+}
+
+void
+Canceller::end()
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_active = false;
+    m_fd = -1;
+}
+
+bool
+Canceller::cancelled() const
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    return m_cancelled;
+}
+
+void
+Canceller::attach(int fd)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_fd = fd;
+    if (m_cancelled && m_fd >= 0)
+        shutdown(m_fd, SHUT_RDWR);
+}
+
+void
+Canceller::detach()
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_fd = -1;
+}
+
+Deadline::Deadline(double timeout, Canceller *canceller)
+  : m_end(timeout > 0 ? now_seconds() + timeout : 0), m_last_signal_check(now_seconds()),
+    m_interrupted(false), m_stopped(false), m_canceller(canceller)
+{
+    if (m_canceller)
+        m_canceller->begin();
+}
+
+Deadline::~Deadline()
+{
+    if (m_canceller)
+        m_canceller->end();
+}
+
+bool
+Deadline::expired() const
+{
+    return m_end && (now_seconds() >= m_end);
+}
+
+bool
+Deadline::cancelled() const
+{
+    return m_canceller && m_canceller->cancelled();
+}
+
+int
+Deadline::remaining(int default_timeout) const
+{
+    if (!m_end)
+        return default_timeout;
+    double left = ceil(m_end - now_seconds());
+    return left < 1 ? 1 : static_cast<int>(left);
+}
+
+bool
+Deadline::poll()
+{
+    double now = now_seconds();
+    if (!m_interrupted && (now - m_last_signal_check >= SIGNAL_CHECK_INTERVAL))
+    {
+        m_last_signal_check = now;
+        PyGILState_STATE state = PyGILState_Ensure();
+        // Leaves the KeyboardInterrupt set for check() to raise.
+        m_interrupted = PyErr_CheckSignals() == -1;
+        PyGILState_Release(state);
+    }
+    if (m_interrupted || cancelled() || expired())
+        m_stopped = true;
+    return m_stopped;
+}
+
+bool
+Deadline::waitReadable(int fd)
+{
+    return waitReadable(std::vector<int>(1, fd)) == 0;
+}
+
+int
+Deadline::waitReadable(const std::vector<int> &fds, double max_wait)
+{
+    std::vector<struct pollfd> pfds(fds.size());
+    double give_up = now_seconds() + max_wait;
+    while (!poll())
+    {
+        double wait_time = SIGNAL_CHECK_INTERVAL;
+        if (m_end)
+            wait_time = std::min(wait_time, m_end - now_seconds());
+        if (max_wait >= 0)
+        {
+            double left = give_up - now_seconds();
+            if (left <= 0)
+                return -1;
+            wait_time = std::min(wait_time, left);
+        }
+        for (size_t idx=0; idx<fds.size(); idx++)
+        {
+            pfds[idx].fd = fds[idx];
+            pfds[idx].events = POLLIN;
+            pfds[idx].revents = 0;
+        }
+        if (::poll(&pfds[0], pfds.size(), wait_time > 0 ? static_cast<int>(wait_time*1000) + 1 : 0) > 0)
+        {
+            for (size_t idx=0; idx<pfds.size(); idx++)
+            {
+                if (pfds[idx].revents)
+                    return idx;
+            }
+        }
+    }
+    return -1;
+}
+
+void
+Deadline::check(bool failed)
+{
+    if (failed)
+        poll();
+    if (!m_stopped)
+        return;
+    if (m_interrupted)
+    {
+        boost::python::throw_error_already_set();
+    }
+    if (cancelled())
+    {
+        PyErr_SetString(PyExc_IOError, "Operation was cancelled.");
+        boost::python::throw_error_already_set();
+    }
+    if (expired())
+    {
+        PyErr_SetString(PyExc_IOError, "Operation timed out.");
+        boost::python::throw_error_already_set();
+    }
+}
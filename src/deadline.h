@@ -0,0 +1,90 @@
+
+#ifndef __DEADLINE_H_
+#define __DEADLINE_H_
+
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+/*
+ * Lets another thread interrupt the network operation in progress on an
+ * object.  The operation attaches the descriptor it blocks on; cancel()
+ * marks the operation cancelled and shuts the descriptor down, so the
+ * blocked call fails promptly instead of waiting out its timeout.
+ */
+class Canceller : boost::noncopyable
+{
+public:
+    Canceller();
+
+    // Safe to call from any thread, without the module lock.
+    void cancel();
+
+    void begin();
+    void end();
+    bool cancelled() const;
+    void attach(int fd);
+    void detach();
+
+private:
+    mutable boost::mutex m_mutex;
+    bool m_active;
+    bool m_cancelled;
+    int m_fd;
+};
+
+/*
+ * The time limit of one call, plus its cancellation state.
+ *
+ * Loops running with the GIL released call poll() between units of work
+ * and stop when it returns true; back in Python, check() raises the
+ * matching exception.  Only work that poll() actually stopped is reported:
+ * a call that completed keeps its result even if the time runs out, or
+ * cancel() arrives, just afterward.  A non-positive timeout means no time
+ * limit.
+ */
+class Deadline : boost::noncopyable
+{
+public:
+    Deadline(double timeout, Canceller *canceller=NULL);
+    ~Deadline();
+
+    bool expired() const;
+    bool cancelled() const;
+
+    // Seconds left, rounded up, for HTCondor timeouts (which treat 0 as
+    // "no limit"); default_timeout when the call has no time limit.
+    int remaining(int default_timeout=0) const;
+
+    // Without the GIL: true if the call should stop, in which case the
+    // call counts as stopped.  Also picks up KeyboardInterrupt, a few times
+    // per second at most.
+    bool poll();
+    bool stopped() const { return m_stopped; }
+
+    // Block until fd is readable, waking up to poll(); false if stopped.
+    bool waitReadable(int fd);
+
+    // Block until one of fds is readable; returns its index, or -1 if
+    // stopped or, for a non-negative max_wait, after max_wait seconds.
+    int waitReadable(const std::vector<int> &fds, double max_wait=-1);
+
+    // With the GIL: raise KeyboardInterrupt, or an IOError if the call
+    // was cancelled or timed out, provided poll() stopped it.  Pass failed
+    // when the call failed without polling, as when a socket times out:
+    // the failure is then put down to the deadline if it has passed or
+    // was cancelled.  Does nothing otherwise.
+    void check(bool failed=false);
+
+    void attach(int fd) { if (m_canceller) m_canceller->attach(fd); }
+    void detach() { if (m_canceller) m_canceller->detach(); }
+
+private:
+    double m_end;
+    double m_last_signal_check;
+    bool m_interrupted;
+    bool m_stopped;
+    Canceller *m_canceller;
+};
+
+#endif
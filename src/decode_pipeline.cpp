@@ -0,0 +1,158 @@
+
+#include "condor_config.h"
+#include "compat_classad.h"
+
+#include <boost/bind.hpp>
+
+#include "decode_pipeline.h"
+
+// Ads handed to a worker at a time.
+#define DECODE_BATCH_SIZE 64
+
+// Runs on the workers, so only parse_wire_ad, never the compat ClassAd.
+static bool
+decode_ad(const WireAd &wire, ClassAdWrapper &result, InternPool *pool)
+{
+    if (!pool)
+        return parse_wire_ad(wire, result);
+    classad::ClassAd ad;
+    if (!parse_wire_ad(wire, ad))
+        return false;
+    pool->copy(ad, result);
+    return true;
+}
+
+static void
+decode_batch(std::vector<WireAd> &input, std::vector<boost::shared_ptr<ClassAdWrapper> > &output, bool &failed, InternPool *pool)
+{
+    output.reserve(output.size() + input.size());
+    for (std::vector<WireAd>::const_iterator it = input.begin(); it != input.end(); it++)
+    {
+        boost::shared_ptr<ClassAdWrapper> ad(new ClassAdWrapper());
+        if (!decode_ad(*it, *ad, pool))
+            failed = true;
+        output.push_back(ad);
+    }
+    std::vector<WireAd>().swap(input);
+}
+
+DecodePipeline::DecodePipeline(int threads, bool intern_strings)
+  : m_in_flight(0), m_stop(false), m_thread_count(threads < 1 ? 1 : threads), m_intern_strings(intern_strings)
+{
+    prepare_wire_parsing();
+}
+
+DecodePipeline::~DecodePipeline()
+{
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        m_stop = true;
+    }
+    m_work_cond.notify_all();
+    m_threads.join_all();
+}
+
+int
+DecodePipeline::configuredThreads()
+{
+    int threads = param_integer("PYTHON_QUERY_DECODE_THREADS", 0);
+    if (threads <= 0)
+        threads = boost::thread::hardware_concurrency();
+    return threads < 1 ? 1 : threads;
+}
+
+bool
+DecodePipeline::put(WireAd &ad)
+{
+    if (!m_filling.get())
+    {
+        m_filling.reset(new Batch());
+        m_filling->input.reserve(DECODE_BATCH_SIZE);
+    }
+    m_filling->input.push_back(WireAd());
+    m_filling->input.back().swap(ad);
+    if (m_filling->input.size() >= DECODE_BATCH_SIZE)
+        submit();
+    return true;
+}
+
+void
+DecodePipeline::submit()
+{
+    if (!m_threads.size())
+    {
+        for (int idx=0; idx<m_thread_count; idx++)
+            m_threads.create_thread(boost::bind(&DecodePipeline::run, this));
+    }
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        m_batches.push_back(m_filling);
+        m_queue.push_back(m_filling);
+        m_in_flight++;
+    }
+    m_work_cond.notify_one();
+    m_filling.reset();
+}
+
+void
+DecodePipeline::wait()
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    while (m_in_flight)
+        m_done_cond.wait(lock);
+}
+
+void
+DecodePipeline::run()
+{
+    while (true)
+    {
+        boost::shared_ptr<Batch> batch;
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            while (m_queue.empty() && !m_stop)
+                m_work_cond.wait(lock);
+            if (m_stop)
+                return;
+            batch = m_queue.front();
+            m_queue.pop_front();
+        }
+        decode_batch(batch->input, batch->output, batch->failed, m_intern_strings ? &m_pool : NULL);
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            if (!--m_in_flight)
+                m_done_cond.notify_all();
+        }
+    }
+}
+
+void
+DecodePipeline::clear()
+{
+    m_filling.reset();
+    wait();
+    m_batches.clear();
+}
+
+bool
+DecodePipeline::finish(std::vector<boost::shared_ptr<ClassAdWrapper> > &ads)
+{
+    bool failed = false;
+    if (m_filling.get() && m_threads.size())
+    {
+        submit();
+    }
+    wait();
+    for (std::vector<boost::shared_ptr<Batch> >::const_iterator it = m_batches.begin(); it != m_batches.end(); it++)
+    {
+        ads.insert(ads.end(), (*it)->output.begin(), (*it)->output.end());
+        failed = failed || (*it)->failed;
+    }
+    if (m_filling.get())
+    {
+        decode_batch(m_filling->input, ads, failed, m_intern_strings ? &m_pool : NULL);
+        m_filling.reset();
+    }
+    m_batches.clear();
+    return !failed;
+}
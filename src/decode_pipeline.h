@@ -0,0 +1,72 @@
+
+#ifndef __DECODE_PIPELINE_H_
+#define __DECODE_PIPELINE_H_
+
+#include <deque>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include "classad_wrapper.h"
+#include "collector_query.h"
+#include "intern_pool.h"
+
+/*
+ * Decodes a large query response on a pool of threads.
+ *
+ * The thread reading the socket only frames each ad; batches of raw ads
+ * are parsed concurrently by the workers, straight into the ClassAdWrapper
+ * objects handed to Python.  Results keep the order of the response.
+ * Workers are started with the first full batch, so small responses are
+ * decoded inline by finish().
+ *
+ * Parsing only involves the ClassAd library, so the workers run without
+ * the module lock or the GIL.  When interning, all the workers draw from
+ * the one pool, so the whole result shares its strings.
+ */
+class DecodePipeline : public QuerySink, boost::noncopyable
+{
+public:
+    DecodePipeline(int threads, bool intern_strings);
+    ~DecodePipeline();
+
+    bool put(WireAd &ad);
+    void clear();
+
+    // Wait for every ad read so far to be decoded and append them to ads,
+    // in order; false if any of them failed to parse.
+    bool finish(std::vector<boost::shared_ptr<ClassAdWrapper> > &ads);
+
+    // From PYTHON_QUERY_DECODE_THREADS; call with the module lock held.
+    static int configuredThreads();
+
+private:
+    struct Batch
+    {
+        Batch() : failed(false) {}
+
+        std::vector<WireAd> input;
+        std::vector<boost::shared_ptr<ClassAdWrapper> > output;
+        bool failed;
+    };
+
+    void submit();
+    void wait();
+    void run();
+
+    boost::mutex m_mutex;
+    boost::condition_variable m_work_cond;
+    boost::condition_variable m_done_cond;
+    std::deque<boost::shared_ptr<Batch> > m_queue;
+    std::vector<boost::shared_ptr<Batch> > m_batches;
+    boost::shared_ptr<Batch> m_filling;
+    size_t m_in_flight;
+    bool m_stop;
+    int m_thread_count;
+    bool m_intern_strings;
+    InternPool m_pool;
+    boost::thread_group m_threads;
+};
+
+#endif
@@ -5,4 +5,6 @@ void export_dc_tool();
 void export_daemon_and_ad_types();
 void export_config();
 void export_secman();
+void export_match_analysis();
+void export_lazy_ad();
 
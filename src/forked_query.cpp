@@ -0,0 +1,229 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "forked_query.h"
+#include "binary_ad.h"
+#include "collector_query.h"
+#include "timing.h"
+
+enum FrameType {
+    FRAME_AD = 1,
+    FRAME_ERROR,
+    FRAME_DONE
+};
+
+#define FRAME_HEADER_SIZE (sizeof(uint8_t) + sizeof(uint32_t))
+#define PIPE_BUFFER_SIZE 65536
+
+static void
+append_frame(std::string &buf, uint8_t type, const std::string &payload)
+{
+    uint32_t len = payload.size();
+    buf.append(reinterpret_cast<const char *>(&type), sizeof(type));
+    buf.append(reinterpret_cast<const char *>(&len), sizeof(len));
+    buf.append(payload);
+}
+
+static bool
+write_all(int fd, const std::string &buf)
+{
+    const char *pos = buf.c_str();
+    size_t remaining = buf.size();
+    while (remaining)
+    {
+        ssize_t written = write(fd, pos, remaining);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        pos += written;
+        remaining -= written;
+    }
+    return true;
+}
+
+class PipeSink : public AdSink
+{
+public:
+    PipeSink(int fd) : m_fd(fd), m_ok(true) {}
+
+    bool put(const classad::ClassAd &ad)
+    {
+        m_ad.clear();
+        serialize_ad(ad, m_ad);
+        append_frame(m_buffer, FRAME_AD, m_ad);
+        return (m_buffer.size() < PIPE_BUFFER_SIZE) || flush();
+    }
+
+    bool flush()
+    {
+        m_ok = m_ok && write_all(m_fd, m_buffer);
+        m_buffer.clear();
+        return m_ok;
+    }
+
+    void finish(const std::string &error)
+    {
+        append_frame(m_buffer, error.empty() ? FRAME_DONE : FRAME_ERROR, error);
+        flush();
+    }
+
+private:
+    int m_fd;
+    bool m_ok;
+    std::string m_ad;
+    std::string m_buffer;
+};
+
+ForkedQuery::ForkedQuery(const Producer &producer)
+  : m_pid(-1), m_fd(-1), m_finished(false), m_done_received(false), m_start(now_seconds())
+{
+    // read() decodes without the module lock.
+    prepare_wire_parsing();
+    int fds[2];
+    if (pipe(fds) == -1)
+    {
+        finish("Unable to create pipe for query worker.");
+        return;
+    }
+    m_pid = fork();
+    if (m_pid == -1)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        finish("Unable to fork query worker.");
+        return;
+    }
+    if (m_pid == 0)
+    {
+        // Leave the interpreter's signal handling behind; the parent decides
+        // when we are no longer needed.
+        signal(SIGINT, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        close(fds[0]);
+        PipeSink sink(fds[1]);
+        std::string error;
+        try
+        {
+            error = producer(sink);
+        }
+        catch (...)
+        {
+            error = "Unexpected exception in query worker.";
+        }
+        sink.finish(error);
+        _exit(error.empty() ? 0 : 1);
+    }
+    close(fds[1]);
+    m_fd = fds[0];
+    fcntl(m_fd, F_SETFD, FD_CLOEXEC);
+    fcntl(m_fd, F_SETFL, fcntl(m_fd, F_GETFL) | O_NONBLOCK);
+}
+
+ForkedQuery::~ForkedQuery()
+{
+    if (!m_finished)
+        kill("Query abandoned.");
+}
+
+double
+ForkedQuery::elapsed() const
+{
+    return now_seconds() - m_start;
+}
+
+bool
+ForkedQuery::read(std::vector<boost::shared_ptr<ClassAdWrapper> > &ads, InternPool *pool)
+{
+    if (m_finished)
+        return false;
+
+    char buf[PIPE_BUFFER_SIZE];
+    bool eof = false;
+    while (true)
+    {
+        ssize_t count = ::read(m_fd, buf, PIPE_BUFFER_SIZE);
+        if (count > 0)
+        {
+            m_buffer.append(buf, count);
+            continue;
+        }
+        if (count < 0 && errno == EINTR)
+            continue;
+        eof = (count == 0) || (errno != EAGAIN && errno != EWOULDBLOCK);
+        break;
+    }
+
+    const char *start = m_buffer.c_str();
+    const char *pos = start;
+    const char *end = start + m_buffer.size();
+    while (static_cast<size_t>(end - pos) >= FRAME_HEADER_SIZE)
+    {
+        uint8_t type; uint32_t len;
+        memcpy(&type, pos, sizeof(type));
+        memcpy(&len, pos + sizeof(type), sizeof(len));
+        if (static_cast<size_t>(end - pos) < FRAME_HEADER_SIZE + len)
+            break;
+        const char *payload = pos + FRAME_HEADER_SIZE;
+        pos = payload + len;
+        if (type == FRAME_AD)
+        {
+            boost::shared_ptr<ClassAdWrapper> wrapper(new ClassAdWrapper());
+            if (!deserialize_ad(payload, pos, *wrapper, pool))
+            {
+                kill("Corrupt ad received from query worker.");
+                return false;
+            }
+            ads.push_back(wrapper);
+        }
+        else if (type == FRAME_ERROR)
+        {
+            m_error.assign(payload, len);
+        }
+        else if (type == FRAME_DONE)
+        {
+            m_done_received = true;
+        }
+    }
+    m_buffer.erase(0, pos - start);
+
+    if (eof)
+    {
+        finish((m_done_received || m_error.size()) ? m_error : "Query worker exited unexpectedly.");
+        return false;
+    }
+    return true;
+}
+
+void
+ForkedQuery::kill(const std::string &reason)
+{
+    if (m_finished)
+        return;
+    if (m_pid > 0)
+        ::kill(m_pid, SIGKILL);
+    finish(reason);
+}
+
+void
+ForkedQuery::finish(const std::string &error)
+{
+    m_error = error;
+    m_finished = true;
+    if (m_fd >= 0)
+    {
+        close(m_fd);
+        m_fd = -1;
+    }
+    if (m_pid > 0)
+    {
+        while ((waitpid(m_pid, NULL, 0) == -1) && (errno == EINTR)) {}
+        m_pid = -1;
+    }
+}
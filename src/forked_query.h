@@ -0,0 +1,72 @@
+
+#ifndef __FORKED_QUERY_H_
+#define __FORKED_QUERY_H_
+
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "classad_wrapper.h"
+
+class InternPool;
+
+// Receives the ads produced by a query worker.
+class AdSink
+{
+public:
+    virtual ~AdSink() {}
+    virtual bool put(const classad::ClassAd &ad) = 0;
+};
+
+/*
+ * Runs a query in a forked child process, which streams its ads back over
+ * a pipe using the binary ad encoding.
+ *
+ * The HTCondor client libraries are not thread-safe, so concurrent
+ * queries each get their own process; a query stuck on an unresponsive
+ * daemon is abandoned by killing its child.
+ */
+class ForkedQuery : boost::noncopyable
+{
+public:
+    // The producer runs in the child; it returns an error message, or an
+    // empty string on success.  It must not call into Python.
+    typedef boost::function<std::string (AdSink &)> Producer;
+
+    // Call with the module lock held: forking must not copy another
+    // thread's half-done HTCondor state.
+    ForkedQuery(const Producer &producer);
+    ~ForkedQuery();
+
+    // Descriptor to poll for readability while the query is running.
+    int fd() const { return m_fd; }
+    bool finished() const { return m_finished; }
+    const std::string &error() const { return m_error; }
+    // Seconds since the child was started.
+    double elapsed() const;
+
+    // Decode all ads currently available without blocking and append them to
+    // ads.  Returns false once the child has finished.  Needs neither the
+    // GIL nor the module lock; pool must not be in use by another thread.
+    bool read(std::vector<boost::shared_ptr<ClassAdWrapper> > &ads, InternPool *pool=NULL);
+
+    // Abandon the query, killing the child.
+    void kill(const std::string &reason);
+
+private:
+    void finish(const std::string &error);
+
+    pid_t m_pid;
+    int m_fd;
+    bool m_finished;
+    bool m_done_received;
+    double m_start;
+    std::string m_buffer;
+    std::string m_error;
+};
+
+#endif
@@ -0,0 +1,69 @@
+
+#include "condor_common.h"
+#include "condor_config.h"
+
+#include "intern_pool.h"
+
+// Longer string values (paths, arguments, environments) rarely repeat
+// between ads; hashing them costs more than sharing them saves.
+#define MAX_INTERNED_VALUE_LENGTH 128
+
+InternPool::InternPool()
+{
+}
+
+bool
+intern_query_strings()
+{
+#if defined(_GLIBCXX_USE_CXX11_ABI) && _GLIBCXX_USE_CXX11_ABI
+    return false;
+#else
+    return param_boolean("PYTHON_INTERN_QUERY_STRINGS", true);
+#endif
+}
+
+const std::string &
+InternPool::intern(const std::string &str)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    return insert(str);
+}
+
+// Entries are never removed, so the returned reference outlives the lock.
+const std::string &
+InternPool::insert(const std::string &str)
+{
+    return *m_strings.insert(str).first;
+}
+
+classad::ExprTree *
+InternPool::copyExpr(const classad::ExprTree *expr)
+{
+    if (expr->GetKind() == classad::ExprTree::LITERAL_NODE)
+    {
+        classad::Value val;
+        static_cast<const classad::Literal *>(expr)->GetValue(val);
+        std::string str;
+        if (val.IsStringValue(str) && str.size() <= MAX_INTERNED_VALUE_LENGTH)
+        {
+            val.SetStringValue(insert(str));
+            return classad::Literal::MakeLiteral(val);
+        }
+    }
+    return expr->Copy();
+}
+
+void
+InternPool::copy(const classad::ClassAd &src, classad::ClassAd &dst)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    for (classad::ClassAd::const_iterator it = src.begin(); it != src.end(); it++)
+    {
+        classad::ExprTree *expr = copyExpr(it->second);
+        if (expr)
+        {
+            // Uncached: the cache is shared, and this runs on decode workers.
+            dst.Insert(insert(it->first), expr, false);
+        }
+    }
+}
@@ -0,0 +1,51 @@
+
+#ifndef __INTERN_POOL_H_
+#define __INTERN_POOL_H_
+
+#include <string>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_set.hpp>
+
+#include "classad/classad_distribution.h"
+
+/*
+ * A pool of attribute names and short string values shared by all the
+ * ads of one query result.
+ *
+ * The ClassAd library keeps names and string literals in std::string;
+ * with the reference-counted strings of the old GCC ABI, every copy handed
+ * out of the pool shares a single buffer.  For large query results, this
+ * removes most of the per-ad string duplication.  The C++11 ABI copies
+ * the characters instead, so there the pool would only add hashing; see
+ * intern_query_strings().  Nothing is shared on such builds: the ClassAd
+ * library owns a private copy of every name and value it is given.
+ *
+ * A pool may be used from several threads at once, as by the workers of a
+ * DecodePipeline; copy() takes its lock once per ad.
+ */
+class InternPool
+{
+public:
+    InternPool();
+
+    const std::string &intern(const std::string &str);
+
+    // Copy all attributes of src into dst, drawing names and string literals from the pool.
+    void copy(const classad::ClassAd &src, classad::ClassAd &dst);
+
+    size_t size() const { return m_strings.size(); }
+
+private:
+    const std::string &insert(const std::string &str);
+    classad::ExprTree *copyExpr(const classad::ExprTree *expr);
+
+    boost::mutex m_mutex;
+    boost::unordered_set<std::string> m_strings;
+};
+
+// Whether query results should be copied through an InternPool: the
+// PYTHON_INTERN_QUERY_STRINGS knob, and never with the C++11 string ABI.
+// Call with the module lock held.
+bool intern_query_strings();
+
+#endif
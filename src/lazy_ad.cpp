@@ -0,0 +1,269 @@
+
+#include "condor_attributes.h"
+
+#include <ctype.h>
+#include <string.h>
+
+#include <algorithm>
+#include <boost/python.hpp>
+#include <boost/python/raw_function.hpp>
+
+#include "old_boost.h"
+#include "lazy_ad.h"
+
+using namespace boost::python;
+
+static int
+compare_names(const char *left, size_t left_len, const char *right, size_t right_len)
+{
+    int result = strncasecmp(left, right, std::min(left_len, right_len));
+    if (result)
+        return result;
+    return (left_len < right_len) ? -1 : (left_len > right_len);
+}
+
+// Orders entries by name, ignoring case, like the ClassAd library does.
+struct EntryOrder
+{
+    EntryOrder(const std::string &text) : m_text(text) {}
+
+    template <typename Entry>
+    bool operator()(const Entry &left, const Entry &right) const
+    {
+        return compare_names(m_text.c_str() + left.offset, left.name_len, m_text.c_str() + right.offset, right.name_len) < 0;
+    }
+
+    const std::string &m_text;
+};
+
+LazyClassAd::LazyClassAd(WireAd &ad)
+  : m_pending(0)
+{
+    // Constructed under the module lock; decoding later does not take it.
+    prepare_wire_parsing();
+    m_text.swap(ad.text);
+    if (ad.my_type.size())
+    {
+        m_text += ATTR_MY_TYPE " = \"" + ad.my_type + "\"";
+        m_text += '\0';
+    }
+    if (ad.target_type.size())
+    {
+        m_text += ATTR_TARGET_TYPE " = \"" + ad.target_type + "\"";
+        m_text += '\0';
+    }
+    size_t pos = 0;
+    while (pos < m_text.size())
+    {
+        size_t end = m_text.find('\0', pos);
+        if (end == std::string::npos)
+            end = m_text.size();
+        addLine(pos, end - pos);
+        pos = end + 1;
+    }
+    sortEntries();
+}
+
+void
+LazyClassAd::addLine(size_t offset, size_t len)
+{
+    const char *line = m_text.c_str() + offset;
+    size_t start = 0;
+    while ((start < len) && isspace(line[start]))
+        start++;
+    const char *equals = static_cast<const char *>(memchr(line + start, '=', len - start));
+    if (!equals)
+        return;
+    size_t end = equals - line;
+    while ((end > start) && isspace(line[end-1]))
+        end--;
+    if (end == start)
+        return;
+    Entry entry;
+    entry.offset = offset + start;
+    entry.name_len = end - start;
+    m_entries.push_back(entry);
+}
+
+void
+LazyClassAd::sortEntries()
+{
+    EntryOrder order(m_text);
+    std::stable_sort(m_entries.begin(), m_entries.end(), order);
+    // When the wire repeats an attribute, the last value wins, as in getClassAd.
+    std::vector<Entry>::iterator last = m_entries.begin();
+    for (std::vector<Entry>::iterator it = m_entries.begin(); it != m_entries.end(); it++)
+    {
+        if ((last != m_entries.begin()) && !order(*(last-1), *it))
+            *(last-1) = *it;
+        else
+            *last++ = *it;
+    }
+    m_entries.erase(last, m_entries.end());
+    m_pending = m_entries.size();
+    m_done.assign(m_entries.size(), false);
+    if (!m_pending)
+        release();
+}
+
+int
+LazyClassAd::find(const std::string &name) const
+{
+    int low = 0, high = m_entries.size();
+    while (low < high)
+    {
+        int mid = (low + high) / 2;
+        const Entry &entry = m_entries[mid];
+        int result = compare_names(m_text.c_str() + entry.offset, entry.name_len, name.c_str(), name.size());
+        if (!result)
+            return mid;
+        if (result < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return -1;
+}
+
+void
+LazyClassAd::decode(int idx)
+{
+    const Entry &entry = m_entries[idx];
+    std::string name;
+    // Parsed as getClassAd would, without needing the module lock.
+    classad::ExprTree *expr = parse_wire_attr(m_text.c_str() + entry.offset, name);
+    if (expr)
+        Insert(name, expr, false);
+    m_done[idx] = true;
+    m_pending--;
+}
+
+void
+LazyClassAd::release()
+{
+    std::string().swap(m_text);
+    std::vector<Entry>().swap(m_entries);
+    std::vector<bool>().swap(m_done);
+}
+
+classad::ExprTree *
+LazyClassAd::materialize(const std::string &name)
+{
+    int idx = find(name);
+    if ((idx >= 0) && !m_done[idx])
+    {
+        decode(idx);
+        if (!m_pending)
+            release();
+    }
+    return Lookup(name);
+}
+
+void
+LazyClassAd::materializeAll()
+{
+    for (size_t idx=0; m_pending && (idx<m_entries.size()); idx++)
+    {
+        if (!m_done[idx])
+            decode(idx);
+    }
+    if (m_entries.size())
+        release();
+}
+
+bool
+LazyClassAd::contains(const std::string &name) const
+{
+    int idx = find(name);
+    return ((idx >= 0) && !m_done[idx]) || Lookup(name);
+}
+
+int
+LazyClassAd::size() const
+{
+    return m_pending + classad::ClassAd::size();
+}
+
+void
+materialize_lazy(const classad::ClassAd &ad)
+{
+    const LazyClassAd *lazy = dynamic_cast<const LazyClassAd *>(&ad);
+    if (lazy)
+        const_cast<LazyClassAd *>(lazy)->materializeAll();
+}
+
+// The classad.ClassAd type, whose methods do the actual work.
+static PyObject *g_classad_type = NULL;
+
+static object
+call_classad(const char *method, tuple args, dict kw)
+{
+    object func = object(handle<>(borrowed(g_classad_type))).attr(method);
+    return object(handle<>(PyObject_Call(func.ptr(), args.ptr(), kw.ptr())));
+}
+
+// A ClassAd method taking an attribute name: decode just that attribute.
+struct AttributeCall
+{
+    AttributeCall(const char *method) : m_method(method) {}
+
+    object operator()(tuple args, dict kw) const
+    {
+        LazyClassAd &ad = extract<LazyClassAd &>(args[0]);
+        extract<std::string> name(args[1]);
+        if (name.check())
+        {
+            classad::ExprTree *expr = ad.materialize(name());
+            // Evaluating anything but a literal may refer to other attributes.
+            if (expr && (expr->GetKind() != classad::ExprTree::LITERAL_NODE))
+                ad.materializeAll();
+        }
+        return call_classad(m_method, args, kw);
+    }
+
+    const char *m_method;
+};
+
+// A ClassAd method using the whole ad: decode everything first.
+struct WholeAdCall
+{
+    WholeAdCall(const char *method) : m_method(method) {}
+
+    object operator()(tuple args, dict kw) const
+    {
+        LazyClassAd &ad = extract<LazyClassAd &>(args[0]);
+        ad.materializeAll();
+        return call_classad(m_method, args, kw);
+    }
+
+    const char *m_method;
+};
+
+void
+export_lazy_ad()
+{
+    object classad_type = py_import("classad").attr("ClassAd");
+    g_classad_type = incref(classad_type.ptr());
+
+    class_<LazyClassAd, boost::shared_ptr<LazyClassAd>, bases<ClassAdWrapper>, boost::noncopyable>("LazyClassAd",
+            "A ClassAd from a query with lazy=True; each attribute is decoded the first time it is accessed.", no_init)
+        .def("__getitem__", raw_function(AttributeCall("__getitem__"), 2))
+        .def("__setitem__", raw_function(AttributeCall("__setitem__"), 3))
+        .def("__delitem__", raw_function(AttributeCall("__delitem__"), 2))
+        .def("get", raw_function(AttributeCall("get"), 2))
+        .def("setdefault", raw_function(AttributeCall("setdefault"), 2))
+        .def("lookup", raw_function(AttributeCall("lookup"), 2))
+        .def("eval", raw_function(AttributeCall("eval"), 2))
+        .def("__iter__", raw_function(WholeAdCall("__iter__"), 1))
+        .def("keys", raw_function(WholeAdCall("keys"), 1))
+        .def("values", raw_function(WholeAdCall("values"), 1))
+        .def("items", raw_function(WholeAdCall("items"), 1))
+        .def("update", raw_function(WholeAdCall("update"), 2))
+        .def("printOld", raw_function(WholeAdCall("printOld"), 1))
+        .def("__str__", raw_function(WholeAdCall("__str__"), 1))
+        .def("__repr__", raw_function(WholeAdCall("__repr__"), 1))
+        .def("__contains__", &LazyClassAd::contains)
+        .def("__len__", &LazyClassAd::size)
+        .add_property("pending", &LazyClassAd::pending, "Number of attributes not decoded yet.")
+        ;
+}
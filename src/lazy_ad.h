@@ -0,0 +1,59 @@
+
+#ifndef __LAZY_AD_H_
+#define __LAZY_AD_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "classad_wrapper.h"
+#include "collector_query.h"
+
+/*
+ * A query result that decodes its attributes on first access.
+ *
+ * The ad starts out empty, holding the unparsed text of each attribute as
+ * sent on the wire.  Python reading an attribute parses just that one into
+ * the underlying ClassAd.  Anything needing the whole ad -- iteration,
+ * printing, or an expression that may refer to other attributes -- first
+ * materializes the rest, so the result behaves exactly like a ClassAd.
+ */
+class LazyClassAd : public ClassAdWrapper
+{
+public:
+    // Takes over the text of ad.
+    LazyClassAd(WireAd &ad);
+
+    // Bring one attribute into the underlying ClassAd; returns it, or NULL.
+    classad::ExprTree *materialize(const std::string &name);
+    void materializeAll();
+
+    bool contains(const std::string &name) const;
+    int size() const;
+    int pending() const { return m_pending; }
+
+private:
+    struct Entry
+    {
+        uint32_t offset;
+        uint32_t name_len;
+    };
+
+    void addLine(size_t offset, size_t len);
+    void sortEntries();
+    int find(const std::string &name) const;
+    void decode(int idx);
+    void release();
+
+    // The NUL-terminated line of each attribute.
+    std::string m_text;
+    std::vector<Entry> m_entries;
+    std::vector<bool> m_done;
+    int m_pending;
+};
+
+// C++ code reading a ClassAdWrapper directly must call this first.
+void materialize_lazy(const classad::ClassAd &ad);
+
+#endif
@@ -0,0 +1,18 @@
+
+#ifndef __LAZY_CONFIG_H_
+#define __LAZY_CONFIG_H_
+
+/*
+ * Load the HTCondor configuration, the first time only.
+ *
+ * Importing the module does not read the configuration; every entry point
+ * that needs it (param, Collector, Schedd, send_command, ...) calls this
+ * first.  Takes the module lock; call with the GIL held.
+ *
+ * When _condor_PYTHON_MINIMAL_CONFIG is set to true in the environment,
+ * the configuration files are skipped and only the _condor_ settings of
+ * the environment are loaded; other knobs keep their built-in defaults.
+ */
+void ensure_config();
+
+#endif
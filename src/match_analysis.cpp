@@ -0,0 +1,339 @@
+
+#include "condor_attributes.h"
+
+#include <boost/python.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include "old_boost.h"
+#include "classad_wrapper.h"
+#include "lazy_ad.h"
+#include "module_lock.h"
+#include "collector_query.h"
+#include "lazy_config.h"
+
+using namespace boost::python;
+
+/*
+ * Client-side match analysis: evaluates every job against every slot, in
+ * the spirit of condor_q -better-analyze, but for whole queues at once.
+ *
+ * Evaluation runs on plain threads, without the GIL or the module lock.
+ * This is safe because:
+ * - the ads are snapshots taken with the GIL held, so other Python threads
+ *   cannot change them underneath the workers, and the workers only read
+ *   the snapshots;
+ * - matching rewrites the scopes of the ads involved, so each thread
+ *   evaluates its own copies: all the jobs, and its slice of the slots;
+ * - the ClassAd library's shared state is its function table, filled on
+ *   first use; prepare_wire_parsing() fills it under the module lock
+ *   before any worker starts;
+ * - the functions HTCondor adds to the library are string and list
+ *   manipulations that touch neither the configuration nor sockets.  The
+ *   exception is userHome, which reads the password database with the
+ *   non-reentrant getpwnam; analyze ads using it with threads=1.
+ */
+
+// Split an expression into its top-level && clauses.
+static void
+split_clauses(classad::ExprTree *expr, std::vector<classad::ExprTree *> &clauses)
+{
+    if (expr && (expr->GetKind() == classad::ExprTree::OP_NODE))
+    {
+        classad::Operation::OpKind kind;
+        classad::ExprTree *left, *right, *extra;
+        static_cast<classad::Operation *>(expr)->GetComponents(kind, left, right, extra);
+        if (kind == classad::Operation::PARENTHESES_OP)
+        {
+            split_clauses(left, clauses);
+            return;
+        }
+        if (kind == classad::Operation::LOGICAL_AND_OP)
+        {
+            split_clauses(left, clauses);
+            split_clauses(right, clauses);
+            return;
+        }
+    }
+    if (expr)
+        clauses.push_back(expr);
+}
+
+// The results for one job over a range of slots.
+struct MatchCounts
+{
+    MatchCounts() : matches(0), job_matches(0), slot_matches(0), best_rank(0), best_slot(-1) {}
+
+    void merge(const MatchCounts &other)
+    {
+        matches += other.matches;
+        job_matches += other.job_matches;
+        slot_matches += other.slot_matches;
+        // Slices are merged in slot order, so ties go to the earlier slot.
+        if ((other.best_slot >= 0) && ((best_slot < 0) || (other.best_rank > best_rank)))
+        {
+            best_rank = other.best_rank;
+            best_slot = other.best_slot;
+        }
+        if (clause_matches.size() < other.clause_matches.size())
+            clause_matches.resize(other.clause_matches.size(), 0);
+        for (size_t idx=0; idx<other.clause_matches.size(); idx++)
+            clause_matches[idx] += other.clause_matches[idx];
+    }
+
+    int matches, job_matches, slot_matches;
+    double best_rank;
+    int best_slot;
+    std::vector<int> clause_matches;
+};
+
+class MatchStop
+{
+public:
+    MatchStop() : m_stop(false) {}
+
+    void stop() { boost::mutex::scoped_lock lock(m_mutex); m_stop = true; }
+    bool stopped() { boost::mutex::scoped_lock lock(m_mutex); return m_stop; }
+
+private:
+    boost::mutex m_mutex;
+    bool m_stop;
+};
+
+class MatchWorker
+{
+public:
+    MatchWorker(const std::vector<const classad::ClassAd *> &jobs, const std::vector<const classad::ClassAd *> &slots,
+        size_t first_slot, size_t slot_count, MatchStop &stop)
+      : m_jobs(jobs), m_slots(slots), m_first_slot(first_slot), m_slot_count(slot_count), m_stop(stop), m_results(jobs.size())
+    {}
+
+    void run()
+    {
+        std::vector<classad::ClassAd *> slots;
+        slots.reserve(m_slot_count);
+        for (size_t idx=m_first_slot; idx<m_first_slot+m_slot_count; idx++)
+        {
+            classad::ClassAd *slot = new classad::ClassAd();
+            slot->CopyFrom(*m_slots[idx]);
+            slots.push_back(slot);
+        }
+
+        classad::MatchClassAd match;
+        for (size_t job_idx=0; (job_idx<m_jobs.size()) && !m_stop.stopped(); job_idx++)
+        {
+            classad::ClassAd job;
+            job.CopyFrom(*m_jobs[job_idx]);
+            std::vector<classad::ExprTree *> clauses;
+            split_clauses(job.Lookup(ATTR_REQUIREMENTS), clauses);
+            MatchCounts &counts = m_results[job_idx];
+            counts.clause_matches.resize(clauses.size(), 0);
+
+            match.ReplaceLeftAd(&job);
+            for (size_t slot_idx=0; slot_idx<slots.size(); slot_idx++)
+            {
+                match.ReplaceRightAd(slots[slot_idx]);
+                bool job_match = false, slot_match = false;
+                job.EvaluateAttrBool(ATTR_REQUIREMENTS, job_match);
+                slots[slot_idx]->EvaluateAttrBool(ATTR_REQUIREMENTS, slot_match);
+                if (job_match) counts.job_matches++;
+                if (slot_match) counts.slot_matches++;
+                for (size_t clause_idx=0; clause_idx<clauses.size(); clause_idx++)
+                {
+                    classad::Value value; bool result = false;
+                    if (clauses[clause_idx]->Evaluate(value) && value.IsBooleanValueEquiv(result) && result)
+                        counts.clause_matches[clause_idx]++;
+                }
+                if (job_match && slot_match)
+                {
+                    counts.matches++;
+                    double rank = 0;
+                    job.EvaluateAttrNumber(ATTR_RANK, rank);
+                    if ((counts.best_slot < 0) || (rank > counts.best_rank))
+                    {
+                        counts.best_rank = rank;
+                        counts.best_slot = m_first_slot + slot_idx;
+                    }
+                }
+                match.RemoveRightAd();
+            }
+            match.RemoveLeftAd();
+        }
+
+        for (std::vector<classad::ClassAd *>::iterator it = slots.begin(); it != slots.end(); it++)
+            delete *it;
+    }
+
+    const std::vector<MatchCounts> &results() const { return m_results; }
+
+private:
+    const std::vector<const classad::ClassAd *> &m_jobs;
+    const std::vector<const classad::ClassAd *> &m_slots;
+    size_t m_first_slot, m_slot_count;
+    MatchStop &m_stop;
+    std::vector<MatchCounts> m_results;
+};
+
+static classad::ExprTree *
+make_list(const std::vector<classad::ExprTree *> &items)
+{
+    return classad::ExprList::MakeExprList(items);
+}
+
+static classad::ExprTree *
+make_literal(const std::string &str)
+{
+    classad::Value value; value.SetStringValue(str);
+    return classad::Literal::MakeLiteral(value);
+}
+
+static classad::ExprTree *
+make_literal(int num)
+{
+    classad::Value value; value.SetIntegerValue(num);
+    return classad::Literal::MakeLiteral(value);
+}
+
+list
+analyze_matches(list jobs, list slots, int threads=0)
+{
+    ensure_config();
+    std::vector<boost::shared_ptr<classad::ClassAd> > snapshots;
+    std::vector<const classad::ClassAd *> job_ads, slot_ads;
+    int len_jobs = py_len(jobs), len_slots = py_len(slots);
+    snapshots.reserve(len_jobs + len_slots);
+    job_ads.reserve(len_jobs);
+    slot_ads.reserve(len_slots);
+    for (int i=0; i<len_jobs; i++)
+    {
+        const ClassAdWrapper &ad = extract<const ClassAdWrapper &>(jobs[i]);
+        materialize_lazy(ad);
+        snapshots.push_back(boost::shared_ptr<classad::ClassAd>(new classad::ClassAd(ad)));
+        job_ads.push_back(snapshots.back().get());
+    }
+    for (int i=0; i<len_slots; i++)
+    {
+        const ClassAdWrapper &ad = extract<const ClassAdWrapper &>(slots[i]);
+        materialize_lazy(ad);
+        snapshots.push_back(boost::shared_ptr<classad::ClassAd>(new classad::ClassAd(ad)));
+        slot_ads.push_back(snapshots.back().get());
+    }
+    {
+        ModuleLock lock;
+        prepare_wire_parsing();
+    }
+
+    if (threads <= 0)
+        threads = boost::thread::hardware_concurrency();
+    if (threads <= 0)
+        threads = 1;
+    if (threads > len_slots)
+        threads = len_slots ? len_slots : 1;
+
+    MatchStop stop;
+    std::vector<boost::shared_ptr<MatchWorker> > workers;
+    boost::thread_group group;
+    size_t first_slot = 0;
+    for (int idx=0; idx<threads; idx++)
+    {
+        size_t count = (len_slots - first_slot) / (threads - idx);
+        workers.push_back(boost::shared_ptr<MatchWorker>(new MatchWorker(job_ads, slot_ads, first_slot, count, stop)));
+        first_slot += count;
+    }
+    bool interrupted = false;
+    Py_BEGIN_ALLOW_THREADS
+    std::vector<boost::thread *> running;
+    for (std::vector<boost::shared_ptr<MatchWorker> >::iterator it = workers.begin(); it != workers.end(); it++)
+        running.push_back(group.create_thread(boost::bind(&MatchWorker::run, it->get())));
+    for (std::vector<boost::thread *>::iterator it = running.begin(); it != running.end(); it++)
+    {
+        while (!(*it)->timed_join(boost::posix_time::milliseconds(200)))
+        {
+            PyGILState_STATE state = PyGILState_Ensure();
+            if (!interrupted && (PyErr_CheckSignals() == -1))
+            {
+                interrupted = true;
+                stop.stop();
+            }
+            PyGILState_Release(state);
+        }
+    }
+    Py_END_ALLOW_THREADS
+    if (interrupted)
+        throw_error_already_set();
+
+    list results;
+    for (int job_idx=0; job_idx<len_jobs; job_idx++)
+    {
+        MatchCounts counts;
+        for (std::vector<boost::shared_ptr<MatchWorker> >::const_iterator it = workers.begin(); it != workers.end(); it++)
+            counts.merge((*it)->results()[job_idx]);
+
+        const classad::ClassAd &job = *job_ads[job_idx];
+        std::vector<classad::ExprTree *> clauses;
+        split_clauses(job.Lookup(ATTR_REQUIREMENTS), clauses);
+        counts.clause_matches.resize(clauses.size(), 0);
+
+        boost::shared_ptr<ClassAdWrapper> result(new ClassAdWrapper());
+        int id;
+        if (job.EvaluateAttrInt(ATTR_CLUSTER_ID, id)) result->InsertAttr(ATTR_CLUSTER_ID, id);
+        if (job.EvaluateAttrInt(ATTR_PROC_ID, id)) result->InsertAttr(ATTR_PROC_ID, id);
+        result->InsertAttr("Slots", len_slots);
+        result->InsertAttr("MatchingSlots", counts.matches);
+        result->InsertAttr("JobRequirementsMatch", counts.job_matches);
+        result->InsertAttr("SlotRequirementsMatch", counts.slot_matches);
+        if (counts.best_slot >= 0)
+        {
+            result->InsertAttr("BestRank", counts.best_rank);
+            std::string name;
+            if (slot_ads[counts.best_slot]->EvaluateAttrString(ATTR_NAME, name))
+                result->InsertAttr("BestSlot", name);
+        }
+
+        classad::ClassAdUnParser unparser;
+        std::vector<classad::ExprTree *> clause_strs, clause_counts;
+        int most_rejected = -1;
+        std::string most_rejecting;
+        for (size_t idx=0; idx<clauses.size(); idx++)
+        {
+            std::string text;
+            unparser.Unparse(text, clauses[idx]);
+            clause_strs.push_back(make_literal(text));
+            clause_counts.push_back(make_literal(counts.clause_matches[idx]));
+            int rejected = len_slots - counts.clause_matches[idx];
+            if (rejected > most_rejected)
+            {
+                most_rejected = rejected;
+                most_rejecting = text;
+            }
+        }
+        classad::ExprTree *expr = make_list(clause_strs);
+        result->Insert("Clauses", expr);
+        expr = make_list(clause_counts);
+        result->Insert("ClauseMatches", expr);
+        if (most_rejected >= 0)
+        {
+            result->InsertAttr("MostRejectingClause", most_rejecting);
+            result->InsertAttr("MostRejectingCount", most_rejected);
+        }
+        results.append(result);
+    }
+    return results;
+}
+
+BOOST_PYTHON_FUNCTION_OVERLOADS(analyze_matches_overloads, analyze_matches, 2, 3);
+
+void
+export_match_analysis()
+{
+    def("analyzeMatches", analyze_matches, analyze_matches_overloads(args("jobs", "slots", "threads"),
+        "Evaluate every job against every slot, like condor_q -better-analyze for a whole queue.\n"
+        ":param jobs: A list of job ClassAds.\n"
+        ":param slots: A list of machine ClassAds, such as the result of Collector.query(AdTypes.Startd).\n"
+        ":param threads: Number of threads to use; defaults to one per core.  "
+        "Use 1 when the ads call userHome, whose password lookups are not thread-safe.\n"
+        ":return: A list with one ClassAd per job, in order: MatchingSlots (slots where both Requirements match), "
+        "JobRequirementsMatch, SlotRequirementsMatch, BestRank and BestSlot (the Name of the highest-ranked matching slot), "
+        "Clauses and ClauseMatches (the top-level && clauses of the job's Requirements and the slots satisfying each), "
+        "and MostRejectingClause with MostRejectingCount, the clause eliminating the most slots."));
+}
@@ -0,0 +1,27 @@
+
+#include <boost/python.hpp>
+
+#include "module_lock.h"
+
+static boost::recursive_mutex g_module_mutex;
+
+ModuleLock::ModuleLock()
+{
+    if (!g_module_mutex.try_lock())
+    {
+        Py_BEGIN_ALLOW_THREADS
+        g_module_mutex.lock();
+        Py_END_ALLOW_THREADS
+    }
+}
+
+ModuleLock::~ModuleLock()
+{
+    g_module_mutex.unlock();
+}
+
+boost::recursive_mutex &
+ModuleLock::mutex()
+{
+    return g_module_mutex;
+}
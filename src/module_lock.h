@@ -0,0 +1,26 @@
+
+#ifndef __MODULE_LOCK_H_
+#define __MODULE_LOCK_H_
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/recursive_mutex.hpp>
+
+/*
+ * The HTCondor client libraries are not thread-safe; every call into them
+ * must be made while holding the module mutex.
+ *
+ * A ModuleLock is taken by code called from Python.  It waits for the
+ * mutex with the GIL released, so background threads, which hold the mutex
+ * but never the GIL, cannot deadlock against the interpreter.  Threads
+ * running without the GIL lock mutex() directly.
+ */
+class ModuleLock : boost::noncopyable
+{
+public:
+    ModuleLock();
+    ~ModuleLock();
+
+    static boost::recursive_mutex &mutex();
+};
+
+#endif
@@ -0,0 +1,212 @@
+
+#include "condor_common.h"
+#include "condor_config.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <sstream>
+#include <boost/shared_ptr.hpp>
+
+#include "classad_wrapper.h"
+#include "binary_ad.h"
+#include "intern_pool.h"
+#include "query_cache.h"
+
+using namespace boost::python;
+
+#define SNAPSHOT_MAGIC "PYCQSNAP"
+#define SNAPSHOT_VERSION 1
+
+struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t key_length;
+    int64_t created;
+    int64_t expires;
+    uint64_t ad_count;
+    uint64_t data_length;
+};
+
+// Snapshots are trusted, so only use a directory private to this user.
+static bool
+cache_directory(std::string &dir)
+{
+    if (!param(dir, "PYTHON_QUERY_CACHE_DIR"))
+    {
+        std::stringstream ss; ss << "/tmp/python_condor_cache." << geteuid();
+        dir = ss.str();
+    }
+    if ((mkdir(dir.c_str(), 0700) == -1) && (errno != EEXIST))
+        return false;
+    struct stat st;
+    if (lstat(dir.c_str(), &st) == -1)
+        return false;
+    return S_ISDIR(st.st_mode) && (st.st_uid == geteuid()) && !(st.st_mode & (S_IWGRP | S_IWOTH));
+}
+
+QueryCache::QueryCache(const std::string &pool, AdTypes ad_type, const std::string &constraint,
+        const std::vector<std::string> &attrs)
+  : m_ttl(param_integer("PYTHON_QUERY_CACHE_TTL", 0)), m_lock_fd(-1)
+{
+    if (!enabled())
+        return;
+
+    std::string dir;
+    if (!cache_directory(dir))
+    {
+        m_ttl = 0;
+        return;
+    }
+
+    std::string pool_name = pool;
+    if (pool_name.empty())
+        param(pool_name, "COLLECTOR_HOST");
+    std::stringstream key;
+    key << pool_name << '\n' << ad_type << '\n' << constraint << '\n';
+    for (std::vector<std::string>::const_iterator it = attrs.begin(); it != attrs.end(); it++)
+        key << *it << ',';
+    m_key = key.str();
+
+    std::stringstream path;
+    path << dir << "/query_" << std::hex << hash_bytes(m_key) << ".snapshot";
+    m_path = path.str();
+}
+
+QueryCache::~QueryCache()
+{
+    if (m_lock_fd >= 0)
+        close(m_lock_fd);
+}
+
+bool
+QueryCache::load(list &result)
+{
+    if (read(result))
+        return true;
+    // Another process may have refreshed the snapshot while we waited.
+    return lock() && read(result);
+}
+
+bool
+QueryCache::lock()
+{
+    std::string lock_path = m_path + ".lock";
+    m_lock_fd = open(lock_path.c_str(), O_RDWR | O_CREAT, 0600);
+    if (m_lock_fd < 0)
+        return false;
+
+    // Do not wait forever on a process stuck talking to the collector.
+    int lock_timeout = param_integer("PYTHON_QUERY_CACHE_LOCK_TIMEOUT", 30);
+    bool locked = false;
+    Py_BEGIN_ALLOW_THREADS
+    for (int waited = 0; !(locked = (flock(m_lock_fd, LOCK_EX | LOCK_NB) == 0)) && (waited < 20*lock_timeout); waited++)
+    {
+        usleep(50000);
+    }
+    Py_END_ALLOW_THREADS
+    return locked;
+}
+
+bool
+QueryCache::read(list &result)
+{
+    int fd = open(m_path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if ((fstat(fd, &st) == -1) || (st.st_size < static_cast<off_t>(sizeof(SnapshotHeader))))
+    {
+        close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    const char *pos = static_cast<const char *>(map);
+    const char *end = pos + st.st_size;
+    SnapshotHeader header;
+    memcpy(&header, pos, sizeof(header));
+    pos += sizeof(header);
+    time_t now = time(NULL);
+    bool valid = !memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic))
+        && (header.version == SNAPSHOT_VERSION)
+        && (header.created <= now) && (now < header.expires)
+        && (header.key_length == m_key.size())
+        && (static_cast<uint64_t>(end - pos) == header.key_length + header.data_length)
+        && (header.ad_count <= header.data_length)
+        && !memcmp(pos, m_key.c_str(), header.key_length);
+
+    std::vector<boost::shared_ptr<ClassAdWrapper> > ads;
+    if (valid)
+    {
+        pos += header.key_length;
+        InternPool pool;
+        bool intern_strings = intern_query_strings();
+        ads.reserve(header.ad_count);
+        for (uint64_t idx=0; valid && idx<header.ad_count; idx++)
+        {
+            boost::shared_ptr<ClassAdWrapper> wrapper(new ClassAdWrapper());
+            valid = deserialize_ad(pos, end, *wrapper, intern_strings ? &pool : NULL);
+            ads.push_back(wrapper);
+        }
+    }
+    munmap(map, st.st_size);
+    if (!valid)
+        return false;
+
+    for (std::vector<boost::shared_ptr<ClassAdWrapper> >::const_iterator it = ads.begin(); it != ads.end(); it++)
+        result.append(*it);
+    return true;
+}
+
+void
+QueryCache::store(const std::vector<boost::shared_ptr<ClassAdWrapper> > &ads)
+{
+    std::string data;
+    uint64_t count = ads.size();
+    for (std::vector<boost::shared_ptr<ClassAdWrapper> >::const_iterator it = ads.begin(); it != ads.end(); it++)
+    {
+        serialize_ad(**it, data);
+    }
+
+    SnapshotHeader header;
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.key_length = m_key.size();
+    header.created = time(NULL);
+    header.expires = header.created + m_ttl;
+    header.ad_count = count;
+    header.data_length = data.size();
+
+    // Write a private copy, then rename it into place; readers holding the
+    // old mapping keep a consistent view.
+    std::stringstream tmp_path; tmp_path << m_path << ".tmp." << getpid();
+    int fd = open(tmp_path.str().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        return;
+    std::string contents(reinterpret_cast<const char *>(&header), sizeof(header));
+    contents += m_key;
+    contents += data;
+    const char *pos = contents.c_str();
+    size_t remaining = contents.size();
+    while (remaining)
+    {
+        ssize_t written = write(fd, pos, remaining);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            break;
+        pos += written;
+        remaining -= written;
+    }
+    close(fd);
+    if (remaining || (rename(tmp_path.str().c_str(), m_path.c_str()) == -1))
+        unlink(tmp_path.str().c_str());
+}
@@ -0,0 +1,51 @@
+
+#ifndef __QUERY_CACHE_H_
+#define __QUERY_CACHE_H_
+
+#include "condor_common.h"
+#include "condor_adtypes.h"
+#include "compat_classad.h"
+
+#include <string>
+#include <vector>
+#include <boost/python.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "classad_wrapper.h"
+
+/*
+ * A host-wide cache of collector query results.
+ *
+ * Results are kept in per-user snapshot files keyed by pool, ad type,
+ * constraint and projection; other processes map the snapshot and decode
+ * the binary ads directly, without contacting the collector, until the
+ * snapshot expires.  The cache is enabled by setting
+ * PYTHON_QUERY_CACHE_TTL to a positive number of seconds.
+ */
+class QueryCache
+{
+public:
+    QueryCache(const std::string &pool, AdTypes ad_type, const std::string &constraint,
+        const std::vector<std::string> &attrs);
+    ~QueryCache();
+
+    bool enabled() const { return m_ttl > 0; }
+
+    // Append the ads of an unexpired snapshot to result.  On a miss, the
+    // refresh lock is held until this object is destroyed, so concurrent
+    // processes wait for our store() instead of querying the collector too.
+    bool load(boost::python::list &result);
+
+    void store(const std::vector<boost::shared_ptr<ClassAdWrapper> > &ads);
+
+private:
+    bool read(boost::python::list &result);
+    bool lock();
+
+    std::string m_key;
+    std::string m_path;
+    int m_ttl;
+    int m_lock_fd;
+};
+
+#endif
@@ -0,0 +1,164 @@
+
+#include "condor_qmgr.h"
+#include "condor_config.h"
+#include "reli_sock.h"
+
+#include <boost/thread/mutex.hpp>
+
+#include "module_lock.h"
+#include "queue_connection.h"
+
+/*
+ * The connection used by the qmgmt client library calls.  This file is the
+ * only one touching it: QueueConnection swaps it, and read_queue reads the
+ * GetAllJobsByConstraint reply from it.
+ */
+extern ReliSock *qmgmt_sock;
+
+/*
+ * Guards qmgmt_sock.  Taken after the module lock, never before it.
+ */
+static boost::mutex g_queue_mutex;
+
+// ConnectQ without a timeout would wait on an unreachable schedd forever,
+// and the socket keeps it for every later round trip.
+static int
+queue_timeout(int timeout)
+{
+    return timeout > 0 ? timeout : param_integer("QUERY_TIMEOUT", 60);
+}
+
+/*
+ * GetAllJobsByConstraint_Next parses each job itself, which would leave the
+ * sink nothing to decide; so the reply is read here instead, exactly as
+ * _Next reads it: an int per job, negative (followed by an errno) after
+ * the last one, then the job's ad.
+ */
+bool
+read_queue(const std::string &addr, const std::string &version, const std::string &constraint,
+    const std::string &projection, QuerySink &sink, Deadline &deadline)
+{
+    boost::mutex::scoped_lock queue_lock(g_queue_mutex);
+    CondorError errstack;
+    Qmgr_connection *qmgr = ConnectQ(addr.c_str(), queue_timeout(deadline.remaining()), true, &errstack, NULL, version.c_str());
+    if (!qmgr)
+        return false;
+    bool ok = false;
+    if (GetAllJobsByConstraint_Start(constraint.c_str(), projection.c_str()) < 0)
+    {
+        DisconnectQ(qmgr, false);
+        return false;
+    }
+    // _Start ends with the request sent; the replies are read from here.
+    qmgmt_sock->decode();
+    while (!deadline.poll())
+    {
+        int rval = -1;
+        if (!qmgmt_sock->code(rval))
+            break;
+        if (rval < 0)
+        {
+            int terrno;
+            ok = qmgmt_sock->code(terrno) && qmgmt_sock->end_of_message();
+            break;
+        }
+        if (!sink.read(qmgmt_sock) || !qmgmt_sock->end_of_message())
+            break;
+    }
+    DisconnectQ(qmgr, false);
+    return ok;
+}
+
+// Makes a connection the library's current one for the length of a call.
+// Only calls that reach beyond the socket (ConnectQ authenticates, using
+// the security session cache and the configuration) need the module lock;
+// round trips on an open connection touch nothing but its socket.
+class QueueConnection::Current : boost::noncopyable
+{
+public:
+    Current(QueueConnection &connection, bool module_lock=false)
+      : m_module_lock(ModuleLock::mutex(), boost::defer_lock), m_queue_lock(g_queue_mutex, boost::defer_lock),
+        m_connection(connection)
+    {
+        if (module_lock)
+            m_module_lock.lock();
+        m_queue_lock.lock();
+        m_saved = qmgmt_sock;
+        qmgmt_sock = m_connection.m_sock;
+    }
+
+    // ConnectQ and DisconnectQ replace the socket, so take it back.
+    ~Current()
+    {
+        m_connection.m_sock = qmgmt_sock;
+        qmgmt_sock = m_saved;
+    }
+
+private:
+    boost::recursive_mutex::scoped_lock m_module_lock;
+    boost::mutex::scoped_lock m_queue_lock;
+    QueueConnection &m_connection;
+    ReliSock *m_saved;
+};
+
+QueueConnection::QueueConnection()
+  : m_sock(NULL)
+{
+}
+
+QueueConnection::~QueueConnection()
+{
+    disconnect(false);
+}
+
+bool
+QueueConnection::connect(const std::string &addr, const std::string &version, int timeout)
+{
+    Current current(*this, true);
+    return ConnectQ(addr.c_str(), queue_timeout(timeout), false, NULL, NULL, version.c_str()) != NULL;
+}
+
+int
+QueueConnection::newCluster()
+{
+    Current current(*this);
+    return NewCluster();
+}
+
+int
+QueueConnection::newProc(int cluster)
+{
+    Current current(*this);
+    return NewProc(cluster);
+}
+
+int
+QueueConnection::setAttribute(int cluster, int proc, const char *name, const char *value, SetAttributeFlags_t flags)
+{
+    Current current(*this);
+    return SetAttribute(cluster, proc, name, value, flags);
+}
+
+int
+QueueConnection::setAttributeByConstraint(const char *constraint, const char *name, const char *value)
+{
+    Current current(*this);
+    return SetAttributeByConstraint(constraint, name, value);
+}
+
+int
+QueueConnection::commitTransaction()
+{
+    Current current(*this);
+    return CommitTransaction();
+}
+
+bool
+QueueConnection::disconnect(bool commit)
+{
+    if (!m_sock)
+        return true;
+    Current current(*this);
+    // Without a commit, DisconnectQ reports failure regardless.
+    return DisconnectQ(NULL, commit) || !commit;
+}
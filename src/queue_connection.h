@@ -0,0 +1,70 @@
+
+#ifndef __QUEUE_CONNECTION_H_
+#define __QUEUE_CONNECTION_H_
+
+#include "condor_qmgr.h"
+
+#include <string>
+#include <boost/noncopyable.hpp>
+
+#include "collector_query.h"
+#include "deadline.h"
+
+class ReliSock;
+
+/*
+ * Read the jobs matching constraint, projected on the attributes of
+ * projection, from the schedd at addr one at a time, so the read can stop
+ * at the deadline; the rest of the response is abandoned.  Must be called
+ * with the module lock held and the GIL released.  Without a deadline, the
+ * connection times out after QUERY_TIMEOUT.
+ */
+bool read_queue(const std::string &addr, const std::string &version, const std::string &constraint,
+    const std::string &projection, QuerySink &sink, Deadline &deadline);
+
+/*
+ * A queue management connection owned by one transaction.
+ *
+ * The qmgmt client library keeps its connection in the global qmgmt_sock
+ * and refuses a second ConnectQ while one is open.  A QueueConnection
+ * keeps its own socket and installs it as qmgmt_sock only for the length
+ * of each call, so any number of connections can be open at once, from any
+ * thread, to the same or different schedds.
+ *
+ * Swapping the global still serializes the round trips of all connections,
+ * under a lock of their own: only connect() also takes the module lock, so
+ * a slow schedd stalls other submissions but not collector queries or the
+ * other schedd calls.  Every round trip is bounded by the timeout given to
+ * connect(), QUERY_TIMEOUT when none.
+ *
+ * Every method takes its locks itself and must be called without the GIL.
+ */
+class QueueConnection : boost::noncopyable
+{
+public:
+    QueueConnection();
+    // Drops the connection without committing, if still open.
+    ~QueueConnection();
+
+    // timeout bounds the connection attempt and each later round trip;
+    // QUERY_TIMEOUT when 0.
+    bool connect(const std::string &addr, const std::string &version, int timeout);
+    bool connected() const { return m_sock != NULL; }
+
+    int newCluster();
+    int newProc(int cluster);
+    int setAttribute(int cluster, int proc, const char *name, const char *value, SetAttributeFlags_t flags=0);
+    int setAttributeByConstraint(const char *constraint, const char *name, const char *value);
+    int commitTransaction();
+
+    // Close the connection, first committing the transaction if commit is
+    // set; false if the commit failed.
+    bool disconnect(bool commit);
+
+private:
+    class Current;
+
+    ReliSock *m_sock;
+};
+
+#endif
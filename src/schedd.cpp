@@ -1,31 +1,480 @@
 
 #include "condor_attributes.h"
+#include "condor_config.h"
 #include "condor_q.h"
 #include "condor_qmgr.h"
 #include "daemon.h"
+#include "daemon_names.h"
 #include "daemon_types.h"
 #include "enum_utils.h"
 #include "dc_schedd.h"
+#include "reli_sock.h"
+#include "ipv6_hostname.h"
 
+#include <poll.h>
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <sstream>
 #include <boost/python.hpp>
+#include <boost/bind.hpp>
 
 #include "old_boost.h"
 #include "classad_wrapper.h"
 #include "exprtree_wrapper.h"
+#include "intern_pool.h"
+#include "forked_query.h"
+#include "module_lock.h"
+#include "classad_splitter.h"
+#include "deadline.h"
+#include "lazy_ad.h"
+#include "decode_pipeline.h"
+#include "wire_log.h"
+#include "queue_connection.h"
+#include "lazy_config.h"
 
 using namespace boost::python;
 
 #define DO_ACTION(action_name) \
-    reason_str = extract<std::string>(reason); \
     if (use_ids) \
-        result = schedd. action_name (&ids, reason_str.c_str(), NULL, AR_TOTALS); \
+        result = schedd. action_name (&id_list, reason.c_str(), NULL, AR_TOTALS); \
     else \
-        result = schedd. action_name (constraint.c_str(), reason_str.c_str(), NULL, AR_TOTALS);
+        result = schedd. action_name (constraint.c_str(), reason.c_str(), NULL, AR_TOTALS);
+
+// Runs in a query worker; see ForkedQuery.
+static std::string
+fetch_jobs(const std::string &addr, const std::string &version, const std::string &constraint,
+    const std::vector<std::string> &attrs, AdSink &sink)
+{
+    CondorQ q;
+
+    if (constraint.size())
+        q.addAND(constraint.c_str());
+
+    StringList attrs_list(NULL, "\n");
+    for (std::vector<std::string>::const_iterator it = attrs.begin(); it != attrs.end(); it++)
+        attrs_list.append(it->c_str());
+
+    ClassAdList jobs;
+
+    int fetchResult = q.fetchQueueFromHost(jobs, attrs_list, addr.c_str(), version.c_str(), NULL);
+    switch (fetchResult)
+    {
+    case Q_OK:
+        break;
+    case Q_PARSE_ERROR:
+    case Q_INVALID_CATEGORY:
+        return "Parse error in constraint.";
+    default:
+        return "Failed to fetch ads from schedd.";
+    }
+
+    ClassAd *job;
+    jobs.Open();
+    while ((job = jobs.Next()))
+    {
+        if (!sink.put(*job))
+            return "Failed to pass ads to parent process.";
+    }
+    return "";
+}
+
+// Perform a job action on the jobs listed in ids, or else on those matching
+// constraint; returns NULL on failure.  Must be called with the module lock
+// held; does not need the GIL.
+static ClassAd *
+schedd_action(const std::string &addr, JobAction action, const std::vector<std::string> &ids,
+    const std::string &constraint, const std::string &reason, const std::string &reason_code)
+{
+    DCSchedd schedd(addr.c_str());
+    StringList id_list;
+    for (std::vector<std::string>::const_iterator it = ids.begin(); it != ids.end(); it++)
+        id_list.append(it->c_str());
+    bool use_ids = constraint.empty();
+    ClassAd *result = NULL;
+    VacateType vacate_type;
+    const char *reason_code_char = reason_code.size() ? reason_code.c_str() : NULL;
+    switch (action)
+    {
+    case JA_HOLD_JOBS:
+        if (use_ids)
+            result = schedd.holdJobs(&id_list, reason.c_str(), reason_code_char, NULL, AR_TOTALS);
+        else
+            result = schedd.holdJobs(constraint.c_str(), reason.c_str(), reason_code_char, NULL, AR_TOTALS);
+        break;
+    case JA_RELEASE_JOBS:
+        DO_ACTION(releaseJobs)
+        break;
+    case JA_REMOVE_JOBS:
+        DO_ACTION(removeJobs)
+        break;
+    case JA_REMOVE_X_JOBS:
+        DO_ACTION(removeXJobs)
+        break;
+    case JA_VACATE_JOBS:
+    case JA_VACATE_FAST_JOBS:
+        vacate_type = action == JA_VACATE_JOBS ? VACATE_GRACEFUL : VACATE_FAST;
+        if (use_ids)
+            result = schedd.vacateJobs(&id_list, vacate_type, NULL, AR_TOTALS);
+        else
+            result = schedd.vacateJobs(constraint.c_str(), vacate_type, NULL, AR_TOTALS);
+        break;
+    case JA_SUSPEND_JOBS:
+        DO_ACTION(suspendJobs)
+        break;
+    case JA_CONTINUE_JOBS:
+        DO_ACTION(continueJobs)
+        break;
+    default:
+        break;
+    }
+    return result;
+}
+
+// Runs in a worker process; see ForkedQuery.
+static std::string
+act_in_worker(const std::string &addr, JobAction action, const std::vector<std::string> &ids,
+    const std::string &constraint, const std::string &reason, const std::string &reason_code, AdSink &sink)
+{
+    std::auto_ptr<ClassAd> result(schedd_action(addr, action, ids, constraint, reason, reason_code));
+    if (!result.get())
+        return "Error when querying the schedd.";
+    return sink.put(*result) ? "" : "Failed to pass ads to parent process.";
+}
+
+static bool
+read_jobs(const std::string &addr, const std::string &version, const std::string &constraint,
+    const std::string &projection, std::vector<boost::shared_ptr<ClassAd> > &jobs, Deadline &deadline)
+{
+    ParsedAdSink sink(jobs);
+    return read_queue(addr, version, constraint, projection, sink, deadline);
+}
+
+struct PoolQuery {
+
+    PoolQuery(list schedd_ads, const std::string &constraint="", list attrs=list(), int parallelism=8, int timeout=60, int slow_threshold=10)
+      : m_next_schedd(0), m_constraint(constraint), m_parallelism(parallelism), m_timeout(timeout), m_slow_threshold(slow_threshold),
+        m_intern(false)
+    {
+        ensure_config();
+        {
+            ModuleLock lock;
+            m_intern = intern_query_strings();
+        }
+        if (m_parallelism < 1)
+        {
+            PyErr_SetString(PyExc_ValueError, "Parallelism must be positive.");
+            throw_error_already_set();
+        }
+        int len_ads = py_len(schedd_ads);
+        m_schedds.reserve(len_ads);
+        for (int i=0; i<len_ads; i++)
+        {
+            const ClassAdWrapper &ad = extract<const ClassAdWrapper &>(schedd_ads[i]);
+            materialize_lazy(ad);
+            ScheddLocation location;
+            if (!ad.EvaluateAttrString(ATTR_SCHEDD_IP_ADDR, location.addr))
+            {
+                PyErr_SetString(PyExc_ValueError, "Schedd address not specified.");
+                throw_error_already_set();
+            }
+            if (!ad.EvaluateAttrString(ATTR_NAME, location.name))
+                location.name = location.addr;
+            ad.EvaluateAttrString(ATTR_VERSION, location.version);
+            m_schedds.push_back(location);
+        }
+        int len_attrs = py_len(attrs);
+        for (int i=0; i<len_attrs; i++)
+        {
+            std::string attrName = extract<std::string>(attrs[i]);
+            m_attrs.push_back(attrName);
+        }
+    }
+
+    object next()
+    {
+        while (m_ready.empty())
+        {
+            startWorkers();
+            if (m_running.empty())
+            {
+                PyErr_SetString(PyExc_StopIteration, "All schedds have been queried.");
+                throw_error_already_set();
+            }
+            waitWorkers();
+        }
+        std::pair<size_t, boost::shared_ptr<ClassAdWrapper> > result = m_ready.front();
+        m_ready.pop_front();
+        return boost::python::make_tuple(m_schedds[result.first].name, result.second);
+    }
+
+    dict failures() const { return m_failures; }
+    dict durations() const { return m_durations; }
+    list slow() const { return m_slow; }
+
+private:
+    struct ScheddLocation
+    {
+        std::string name, addr, version;
+    };
+
+    struct Worker
+    {
+        size_t schedd;
+        boost::shared_ptr<ForkedQuery> query;
+    };
+
+    void startWorkers()
+    {
+        // Fork only while no other thread is inside the HTCondor libraries.
+        ModuleLock lock;
+        while ((m_running.size() < static_cast<size_t>(m_parallelism)) && (m_next_schedd < m_schedds.size()))
+        {
+            const ScheddLocation &location = m_schedds[m_next_schedd];
+            Worker worker;
+            worker.schedd = m_next_schedd++;
+            worker.query.reset(new ForkedQuery(boost::bind(fetch_jobs, location.addr, location.version, m_constraint, m_attrs, _1)));
+            m_running.push_back(worker);
+        }
+    }
+
+    void waitWorkers()
+    {
+        std::vector<struct pollfd> fds(m_running.size());
+        double wait_time = m_timeout;
+        for (size_t idx=0; idx<m_running.size(); idx++)
+        {
+            fds[idx].fd = m_running[idx].query->fd();
+            fds[idx].events = POLLIN;
+            fds[idx].revents = 0;
+            wait_time = std::min(wait_time, m_timeout - m_running[idx].query->elapsed());
+        }
+        int wait_ms = wait_time > 0 ? static_cast<int>(wait_time*1000) + 1 : 0;
+        Py_BEGIN_ALLOW_THREADS
+        poll(&fds[0], fds.size(), wait_ms);
+        Py_END_ALLOW_THREADS
+        if (PyErr_CheckSignals() == -1)
+        {
+            throw_error_already_set();
+        }
+
+        std::vector<Worker> still_running;
+        std::vector<boost::shared_ptr<ClassAdWrapper> > ads;
+        for (size_t idx=0; idx<m_running.size(); idx++)
+        {
+            Worker &worker = m_running[idx];
+            ads.clear();
+            bool running = true;
+            if (fds[idx].revents)
+            {
+                running = worker.query->read(ads, m_intern ? &m_pool : NULL);
+            }
+            for (std::vector<boost::shared_ptr<ClassAdWrapper> >::const_iterator it = ads.begin(); it != ads.end(); it++)
+            {
+                m_ready.push_back(std::make_pair(worker.schedd, *it));
+            }
+            if (running && (worker.query->elapsed() >= m_timeout))
+            {
+                std::stringstream ss; ss << "Timed out after " << m_timeout << " seconds.";
+                worker.query->kill(ss.str());
+                running = false;
+            }
+            if (running)
+                still_running.push_back(worker);
+            else
+                record(worker);
+        }
+        m_running.swap(still_running);
+    }
+
+    void record(const Worker &worker)
+    {
+        const std::string &name = m_schedds[worker.schedd].name;
+        double elapsed = worker.query->elapsed();
+        m_durations[name] = elapsed;
+        if (worker.query->error().size())
+            m_failures[name] = worker.query->error();
+        if (elapsed >= m_slow_threshold)
+            m_slow.append(name);
+    }
+
+    std::vector<ScheddLocation> m_schedds;
+    size_t m_next_schedd;
+    std::vector<Worker> m_running;
+    std::deque<std::pair<size_t, boost::shared_ptr<ClassAdWrapper> > > m_ready;
+    std::string m_constraint;
+    std::vector<std::string> m_attrs;
+    int m_parallelism, m_timeout, m_slow_threshold;
+    bool m_intern;
+    InternPool m_pool;
+    dict m_failures, m_durations;
+    list m_slow;
+};
+
+static object pass_through(object const &obj) { return obj; }
+
+#define SUBMIT_READ_SIZE 65536
+
+/*
+ * Produces job ads one at a time from a Python iterable of ClassAds or
+ * ClassAd strings, a file-like object, or the name of a file.  Text is
+ * split and parsed here, so only the ad being submitted is held in memory.
+ */
+struct SubmitSource
+{
+    SubmitSource(object source)
+      : m_file(NULL), m_eof(false)
+    {
+        extract<std::string> path_extract(source);
+        if (path_extract.check())
+        {
+            std::string path = path_extract();
+            if (!(m_file = fopen(path.c_str(), "r")))
+            {
+                PyErr_SetFromErrnoWithFilename(PyExc_IOError, const_cast<char *>(path.c_str()));
+                throw_error_already_set();
+            }
+        }
+        else if (PyObject_HasAttrString(source.ptr(), "read"))
+        {
+            m_read = source.attr("read");
+        }
+        else
+        {
+            m_iter = object(handle<>(PyObject_GetIter(source.ptr())));
+        }
+    }
+
+    ~SubmitSource()
+    {
+        if (m_file) fclose(m_file);
+    }
+
+    // Replace the contents of ad with the next job; false when exhausted.
+    bool next(ClassAd &ad)
+    {
+        ad.Clear();
+        if (m_iter.ptr() != Py_None)
+        {
+            handle<> item(allow_null(PyIter_Next(m_iter.ptr())));
+            if (!item.get())
+            {
+                if (PyErr_Occurred()) throw_error_already_set();
+                return false;
+            }
+            object obj(item);
+            extract<ClassAdWrapper &> ad_extract(obj);
+            if (ad_extract.check())
+            {
+                materialize_lazy(ad_extract());
+                ad.CopyFrom(ad_extract());
+                return true;
+            }
+            extract<std::string> str_extract(obj);
+            if (!str_extract.check())
+            {
+                PyErr_SetString(PyExc_TypeError, "Jobs must be ClassAds or strings.");
+                throw_error_already_set();
+            }
+            parse(str_extract(), ad);
+            return true;
+        }
+
+        std::string text;
+        while (true)
+        {
+            ClassAdSplitter::Status status = m_splitter.next(text);
+            if (status == ClassAdSplitter::SPLIT_AD)
+                break;
+            if (status == ClassAdSplitter::SPLIT_ERROR)
+            {
+                PyErr_SetString(PyExc_SyntaxError, ("Unexpected text between ClassAds: " + text).c_str());
+                throw_error_already_set();
+            }
+            if (m_eof)
+            {
+                if (!m_splitter.empty())
+                {
+                    PyErr_SetString(PyExc_SyntaxError, "Incomplete ClassAd at end of input.");
+                    throw_error_already_set();
+                }
+                return false;
+            }
+            readChunk();
+        }
+        parse(text, ad);
+        return true;
+    }
+
+private:
+    void readChunk()
+    {
+        if (m_file)
+        {
+            char buf[SUBMIT_READ_SIZE];
+            size_t count = fread(buf, 1, SUBMIT_READ_SIZE, m_file);
+            if (ferror(m_file))
+            {
+                PyErr_SetFromErrno(PyExc_IOError);
+                throw_error_already_set();
+            }
+            m_splitter.feed(buf, count);
+            m_eof = count == 0;
+        }
+        else
+        {
+            std::string chunk = extract<std::string>(m_read(SUBMIT_READ_SIZE));
+            m_splitter.feed(chunk.c_str(), chunk.size());
+            m_eof = chunk.empty();
+        }
+    }
+
+    void parse(const std::string &text, ClassAd &ad)
+    {
+        if (!m_parser.ParseClassAd(text, ad, true))
+        {
+            PyErr_SetString(PyExc_SyntaxError, "Unable to parse job ClassAd.");
+            throw_error_already_set();
+        }
+    }
+
+    FILE *m_file;
+    bool m_eof;
+    object m_read;
+    object m_iter;
+    ClassAdSplitter m_splitter;
+    classad::ClassAdParser m_parser;
+};
+
+// The name Daemon::locate() gives the local schedd, worked out without
+// looking for the schedd itself.
+static std::string
+local_schedd_name()
+{
+    std::string name;
+    if (param(name, "SCHEDD_NAME"))
+    {
+        char *valid_name = build_valid_daemon_name(name.c_str());
+        name = valid_name;
+        delete [] valid_name;
+        return name;
+    }
+    return get_local_fqdn().Value();
+}
 
 struct Schedd {
 
     Schedd()
     {
+        ensure_config();
+        ModuleLock lock;
+        // Queries are answered from the replay file, so no schedd needs to
+        // be running; only the name, which keys the recorded queries, matters.
+        if (WireLog("").replaying())
+        {
+            m_name = local_schedd_name();
+            return;
+        }
         Daemon schedd( DT_SCHEDD, 0, 0 );
 
         if (schedd.locate())
@@ -52,6 +501,8 @@ struct Schedd {
     Schedd(const ClassAdWrapper &ad)
       : m_addr(), m_name("Unknown"), m_version("")
     {
+        ensure_config();
+        materialize_lazy(ad);
         if (!ad.EvaluateAttrString(ATTR_SCHEDD_IP_ADDR, m_addr))
         {
             PyErr_SetString(PyExc_ValueError, "Schedd address not specified.");
@@ -61,64 +512,89 @@ struct Schedd {
         ad.EvaluateAttrString(ATTR_VERSION, m_version);
     }
 
-    object query(const std::string &constraint="", list attrs=list())
+    object query(const std::string &constraint="", list attrs=list(), double timeout=0, int shards=1, bool lazy=false)
     {
-        CondorQ q;
-
-        if (constraint.size())
-            q.addAND(constraint.c_str());
-
-        StringList attrs_list(NULL, "\n");
-        // Must keep strings alive; StringList does not create an internal copy.
+        std::string projection;
+        std::vector<std::string> attrs_str;
         int len_attrs = py_len(attrs);
-        std::vector<std::string> attrs_str; attrs_str.reserve(len_attrs);
         for (int i=0; i<len_attrs; i++)
         {
             std::string attrName = extract<std::string>(attrs[i]);
             attrs_str.push_back(attrName);
-            attrs_list.append(attrs_str[i].c_str());
+            if (i) projection += "\n";
+            projection += attrName;
         }
-
-        ClassAdList jobs;
-
-        int fetchResult = q.fetchQueueFromHost(jobs, attrs_list, m_addr.c_str(), m_version.c_str(), NULL);
-        switch (fetchResult)
+        // The schedd answers an unparseable constraint with an empty result.
+        classad::ClassAdParser parser;
+        classad::ExprTree *expr = NULL;
+        if (constraint.size() && !parser.ParseExpression(constraint, expr))
         {
-        case Q_OK:
-            break;
-        case Q_PARSE_ERROR:
-        case Q_INVALID_CATEGORY:
             PyErr_SetString(PyExc_RuntimeError, "Parse error in constraint.");
             throw_error_already_set();
-            break;
-        default:
-            PyErr_SetString(PyExc_IOError, "Failed to fetch ads from schedd.");
-            throw_error_already_set();
-            break;
         }
+        delete expr;
 
+        // Shards are fetched by separate processes, so they are never recorded.
+        WireLog log(WireLog::scheddKey(m_name, constraint, attrs_str));
+        if ((shards > 1) && !log.active())
+        {
+            Deadline deadline(timeout, &m_canceller);
+            return queryShards(constraint.size() ? constraint : "true", attrs_str, shards, deadline);
+        }
+
+        ModuleLock lock;
+        Deadline deadline(timeout, &m_canceller);
         list retval;
-        ClassAd *job;
-        jobs.Open();
-        while ((job = jobs.Next()))
+        bool ok;
+        if (lazy)
+        {
+            std::vector<WireAd> jobs;
+            WireAdSink sink(jobs);
+            Py_BEGIN_ALLOW_THREADS
+            ok = fetchJobs(constraint.size() ? constraint : "true", projection, sink, log, deadline);
+            Py_END_ALLOW_THREADS
+            deadline.check(!ok);
+            log.check();
+            if (!ok)
+            {
+                PyErr_SetString(PyExc_IOError, "Failed to fetch ads from schedd.");
+                throw_error_already_set();
+            }
+            for (std::vector<WireAd>::iterator it = jobs.begin(); it != jobs.end(); it++)
+            {
+                retval.append(boost::shared_ptr<LazyClassAd>(new LazyClassAd(*it)));
+            }
+            return retval;
+        }
+
+        DecodePipeline pipeline(DecodePipeline::configuredThreads(), intern_query_strings());
+        std::vector<boost::shared_ptr<ClassAdWrapper> > jobs;
+        Py_BEGIN_ALLOW_THREADS
+        ok = fetchJobs(constraint.size() ? constraint : "true", projection, pipeline, log, deadline)
+            && pipeline.finish(jobs);
+        Py_END_ALLOW_THREADS
+        deadline.check(!ok);
+        log.check();
+        if (!ok)
+        {
+            PyErr_SetString(PyExc_IOError, "Failed to fetch ads from schedd.");
+            throw_error_already_set();
+        }
+        for (std::vector<boost::shared_ptr<ClassAdWrapper> >::const_iterator it = jobs.begin(); it != jobs.end(); it++)
         {
-            boost::shared_ptr<ClassAdWrapper> wrapper(new ClassAdWrapper());
-            wrapper->CopyFrom(*job);
-            retval.append(wrapper);
+            retval.append(*it);
         }
         return retval;
     }
 
-    object actOnJobs(JobAction action, object job_spec, object reason=object())
+    object actOnJobs(JobAction action, object job_spec, object reason=object(), double timeout=0)
     {
         if (reason == object())
         {
             reason = object("Python-initiated action");
         }
-        StringList ids;
         std::vector<std::string> ids_list;
         std::string constraint, reason_str, reason_code;
-        bool use_ids = false;
         extract<std::string> constraint_extract(job_spec);
         if (constraint_extract.check())
         {
@@ -132,68 +608,57 @@ struct Schedd {
             {
                 std::string str = extract<std::string>(job_spec[i]);
                 ids_list.push_back(str);
-                ids.append(ids_list[i].c_str());
             }
-            use_ids = true;
         }
-        DCSchedd schedd(m_addr.c_str());
-        ClassAd *result = NULL;
-        VacateType vacate_type;
-        tuple reason_tuple;
-        const char *reason_char, *reason_code_char = NULL;
         extract<tuple> try_extract_tuple(reason);
-        switch (action)
+        if ((action == JA_HOLD_JOBS) && try_extract_tuple.check())
         {
-        case JA_HOLD_JOBS:
-            if (try_extract_tuple.check())
-            {
-                reason_tuple = extract<tuple>(reason);
-                if (py_len(reason_tuple) != 2)
-                {
-                    PyErr_SetString(PyExc_ValueError, "Hold action requires (hold string, hold code) tuple as the reason.");
-                    throw_error_already_set();
-                }
-                reason_str = extract<std::string>(reason_tuple[0]); reason_char = reason_str.c_str();
-                reason_code = extract<std::string>(reason_tuple[1]); reason_code_char = reason_code.c_str();
-            }
-            else
+            tuple reason_tuple = extract<tuple>(reason);
+            if (py_len(reason_tuple) != 2)
             {
-                reason_str = extract<std::string>(reason);
-                reason_char = reason_str.c_str();
+                PyErr_SetString(PyExc_ValueError, "Hold action requires (hold string, hold code) tuple as the reason.");
+                throw_error_already_set();
             }
-            if (use_ids)
-                result = schedd.holdJobs(&ids, reason_char, reason_code_char, NULL, AR_TOTALS);
-            else
-                result = schedd.holdJobs(constraint.c_str(), reason_char, reason_code_char, NULL, AR_TOTALS);
-            break;
+            reason_str = extract<std::string>(reason_tuple[0]);
+            reason_code = extract<std::string>(reason_tuple[1]);
+        }
+        else if ((action != JA_VACATE_JOBS) && (action != JA_VACATE_FAST_JOBS))
+        {
+            reason_str = extract<std::string>(reason);
+        }
+        switch (action)
+        {
+        case JA_HOLD_JOBS:
         case JA_RELEASE_JOBS:
-            DO_ACTION(releaseJobs)
-            break;
         case JA_REMOVE_JOBS:
-            DO_ACTION(removeJobs)
-            break;
         case JA_REMOVE_X_JOBS:
-            DO_ACTION(removeXJobs)
-            break;
         case JA_VACATE_JOBS:
         case JA_VACATE_FAST_JOBS:
-            vacate_type = action == JA_VACATE_JOBS ? VACATE_GRACEFUL : VACATE_FAST;
-            if (use_ids)
-                result = schedd.vacateJobs(&ids, vacate_type, NULL, AR_TOTALS);
-            else
-                result = schedd.vacateJobs(constraint.c_str(), vacate_type, NULL, AR_TOTALS);
-            break;
         case JA_SUSPEND_JOBS:
-            DO_ACTION(suspendJobs)
-            break;
         case JA_CONTINUE_JOBS:
-            DO_ACTION(continueJobs)
             break;
         default:
             PyErr_SetString(PyExc_NotImplementedError, "Job action not implemented.");
             throw_error_already_set();
         }
-        if (!result)
+
+        ModuleLock lock;
+        Deadline deadline(timeout, &m_canceller);
+        boost::shared_ptr<classad::ClassAd> result;
+        // DCSchedd blocks, with no timeout of its own; run the action in a
+        // worker process, waited for without the GIL, which cancel(), a
+        // KeyboardInterrupt or the timeout can abandon.
+        ForkedQuery worker(boost::bind(act_in_worker, m_addr, action, ids_list, constraint, reason_str, reason_code, _1));
+        std::vector<boost::shared_ptr<ClassAdWrapper> > results;
+        Py_BEGIN_ALLOW_THREADS
+        while (worker.read(results, NULL) && deadline.waitReadable(worker.fd())) {}
+        Py_END_ALLOW_THREADS
+        deadline.check();
+        if (results.size())
+        {
+            result = results[0];
+        }
+        if (!result.get())
         {
             PyErr_SetString(PyExc_RuntimeError, "Error when querying the schedd.");
             throw_error_already_set();
@@ -217,51 +682,68 @@ struct Schedd {
         return result_obj;
     }
 
-    object actOnJobs2(JobAction action, object job_spec)
+    int submit(ClassAdWrapper &wrapper, int count=1, double timeout=0)
     {
-        return actOnJobs(action, job_spec, object("Python-initiated action."));
+        Deadline deadline(timeout, &m_canceller);
+        ConnectionSentry sentry(*this, deadline); // Aborts unless committed.
+
+        int cluster = newCluster(sentry);
+        materialize_lazy(wrapper);
+        ClassAd ad; ad.CopyFrom(wrapper);
+        for (int idx=0; idx<count; idx++)
+        {
+            sendProc(sentry, cluster, ad);
+        }
+
+        sentry.commit();
+        return cluster;
     }
 
-    int submit(ClassAdWrapper &wrapper, int count=1)
+    list submitMany(object source, int batch_size=1000, double timeout=0)
     {
-        ConnectionSentry sentry(*this); // Automatically connects / disconnects.
-
-        int cluster = NewCluster();
-        if (cluster < 0)
+        if (batch_size < 1)
         {
-            PyErr_SetString(PyExc_RuntimeError, "Failed to create new cluster.");
+            PyErr_SetString(PyExc_ValueError, "Batch size must be positive.");
             throw_error_already_set();
         }
-        ClassAd ad; ad.CopyFrom(wrapper);
-        for (int idx=0; idx<count; idx++)
+        SubmitSource jobs(source);
+
+        Deadline deadline(timeout, &m_canceller);
+        ConnectionSentry sentry(*this, deadline);
+
+        list clusters;
+        int cluster = -1, procs = 0;
+        ClassAd ad;
+        while (jobs.next(ad))
         {
-            int procid = NewProc (cluster);
-            if (procid < 0)
+            if (cluster < 0)
             {
-                PyErr_SetString(PyExc_RuntimeError, "Failed to create new proc id.");
-                throw_error_already_set();
+                cluster = newCluster(sentry);
+                clusters.append(cluster);
             }
-            ad.InsertAttr(ATTR_CLUSTER_ID, cluster);
-            ad.InsertAttr(ATTR_PROC_ID, procid);
-
-            classad::ClassAdUnParser unparser;
-            unparser.SetOldClassAd( true );
-            for (classad::ClassAd::const_iterator it = ad.begin(); it != ad.end(); it++)
+            sendProc(sentry, cluster, ad);
+            // Waiting for each commit bounds the work in flight to one batch.
+            if (++procs == batch_size)
             {
-                std::string rhs;
-                unparser.Unparse(rhs, it->second);
-                if (-1 == SetAttribute(cluster, procid, it->first.c_str(), rhs.c_str(), SetAttribute_NoAck))
+                int rval;
+                Py_BEGIN_ALLOW_THREADS
+                rval = sentry.queue().commitTransaction();
+                Py_END_ALLOW_THREADS
+                if (-1 == rval)
                 {
-                    PyErr_SetString(PyExc_ValueError, it->first.c_str());
+                    sentry.check();
+                    PyErr_SetString(PyExc_RuntimeError, "Failed to commit jobs to the queue.");
                     throw_error_already_set();
                 }
+                cluster = -1;
+                procs = 0;
             }
         }
-
-        return cluster;
+        sentry.commit();
+        return clusters;
     }
 
-    void edit(object job_spec, std::string attr, object val)
+    void edit(object job_spec, std::string attr, object val, double timeout=0)
     {
         std::vector<int> clusters;
         std::vector<int> procs;
@@ -303,13 +785,20 @@ struct Schedd {
             val_str = extract<std::string>(val);
         }
 
-        ConnectionSentry sentry(*this);
+        Deadline deadline(timeout, &m_canceller);
+        ConnectionSentry sentry(*this, deadline);
+        QueueConnection &queue = sentry.queue();
 
+        int rval;
         if (use_ids)
         {
             for (unsigned idx=0; idx<clusters.size(); idx++)
             {
-                if (-1 == SetAttribute(clusters[idx], procs[idx], attr.c_str(), val_str.c_str()))
+                sentry.check();
+                Py_BEGIN_ALLOW_THREADS
+                rval = queue.setAttribute(clusters[idx], procs[idx], attr.c_str(), val_str.c_str());
+                Py_END_ALLOW_THREADS
+                if (-1 == rval)
                 {
                     PyErr_SetString(PyExc_RuntimeError, "Unable to edit job");
                     throw_error_already_set();
@@ -318,52 +807,271 @@ struct Schedd {
         }
         else
         {
-            if (-1 == SetAttributeByConstraint(constraint.c_str(), attr.c_str(), val_str.c_str()))
+            Py_BEGIN_ALLOW_THREADS
+            rval = queue.setAttributeByConstraint(constraint.c_str(), attr.c_str(), val_str.c_str());
+            Py_END_ALLOW_THREADS
+            if (-1 == rval)
             {
                 PyErr_SetString(PyExc_RuntimeError, "Unable to edit jobs matching constraint");
                 throw_error_already_set();
             }
         }
+        sentry.commit();
+    }
+
+    void cancel()
+    {
+        m_canceller.cancel();
     }
 
 private:
+    // Without the GIL: read the jobs into sink, or replay them from the log.
+    bool fetchJobs(const std::string &constraint, const std::string &projection, QuerySink &sink, WireLog &log, Deadline &deadline)
+    {
+        if (log.replaying())
+            return log.replay(sink) == Q_OK;
+        if (!read_queue(m_addr, m_version, constraint, projection, log.wrap(sink), deadline))
+            return false;
+        log.commit();
+        return true;
+    }
+
+    // Split the query into ClusterId ranges holding about the same number of
+    // jobs, each fetched and decoded by its own query worker; the results
+    // are concatenated in ClusterId range order.
+    list queryShards(const std::string &constraint, const std::vector<std::string> &attrs, int shards, Deadline &deadline)
+    {
+        std::vector<boost::shared_ptr<ForkedQuery> > workers;
+        {
+            ModuleLock lock;
+            // A ClusterId-only pass is cheap next to the full fetch.
+            std::vector<boost::shared_ptr<ClassAd> > ids;
+            bool ok;
+            Py_BEGIN_ALLOW_THREADS
+            ok = read_jobs(m_addr, m_version, constraint, ATTR_CLUSTER_ID, ids, deadline);
+            Py_END_ALLOW_THREADS
+            deadline.check(!ok);
+            if (!ok)
+            {
+                PyErr_SetString(PyExc_IOError, "Failed to fetch ads from schedd.");
+                throw_error_already_set();
+            }
+            std::vector<int> clusters;
+            clusters.reserve(ids.size());
+            for (std::vector<boost::shared_ptr<ClassAd> >::const_iterator it = ids.begin(); it != ids.end(); it++)
+            {
+                int cluster;
+                if ((*it)->EvaluateAttrInt(ATTR_CLUSTER_ID, cluster))
+                    clusters.push_back(cluster);
+            }
+            if (clusters.empty())
+                return list();
+            std::sort(clusters.begin(), clusters.end());
+
+            // The first and last ranges are open, so jobs submitted since the
+            // first pass are still returned.
+            std::vector<int> bounds;
+            for (int idx=1; idx<shards; idx++)
+            {
+                int bound = clusters[idx * clusters.size() / shards];
+                if ((bound > clusters.front()) && (bounds.empty() || (bound > bounds.back())))
+                    bounds.push_back(bound);
+            }
+            for (size_t idx=0; idx<=bounds.size(); idx++)
+            {
+                std::stringstream ss;
+                ss << "(" << constraint << ")";
+                if (idx > 0)
+                    ss << " && " ATTR_CLUSTER_ID " >= " << bounds[idx-1];
+                if (idx < bounds.size())
+                    ss << " && " ATTR_CLUSTER_ID " < " << bounds[idx];
+                workers.push_back(boost::shared_ptr<ForkedQuery>(new ForkedQuery(
+                    boost::bind(fetch_jobs, m_addr, m_version, ss.str(), attrs, _1))));
+            }
+        }
+
+        std::vector<std::vector<boost::shared_ptr<ClassAdWrapper> > > results(workers.size());
+        InternPool pool;
+        InternPool *pool_ptr = intern_query_strings() ? &pool : NULL;
+        Py_BEGIN_ALLOW_THREADS
+        while (!deadline.poll())
+        {
+            std::vector<struct pollfd> fds;
+            for (size_t idx=0; idx<workers.size(); idx++)
+            {
+                if (workers[idx]->finished())
+                    continue;
+                struct pollfd pfd;
+                pfd.fd = workers[idx]->fd();
+                pfd.events = POLLIN;
+                pfd.revents = 0;
+                fds.push_back(pfd);
+            }
+            if (fds.empty())
+                break;
+            ::poll(&fds[0], fds.size(), 200);
+            for (size_t idx=0; idx<workers.size(); idx++)
+            {
+                if (!workers[idx]->finished())
+                    workers[idx]->read(results[idx], pool_ptr);
+            }
+        }
+        Py_END_ALLOW_THREADS
+        // Unfinished workers are killed as they go out of scope.
+        deadline.check();
+
+        list retval;
+        for (size_t idx=0; idx<workers.size(); idx++)
+        {
+            if (workers[idx]->error().size())
+            {
+                PyErr_SetString(PyExc_IOError, ("Failed to fetch ads from schedd: " + workers[idx]->error()).c_str());
+                throw_error_already_set();
+            }
+            for (std::vector<boost::shared_ptr<ClassAdWrapper> >::const_iterator it = results[idx].begin(); it != results[idx].end(); it++)
+                retval.append(*it);
+        }
+        return retval;
+    }
+
+    struct ConnectionSentry;
+
+    int newCluster(ConnectionSentry &sentry)
+    {
+        int cluster;
+        Py_BEGIN_ALLOW_THREADS
+        cluster = sentry.queue().newCluster();
+        Py_END_ALLOW_THREADS
+        if (cluster < 0)
+        {
+            sentry.check();
+            PyErr_SetString(PyExc_RuntimeError, "Failed to create new cluster.");
+            throw_error_already_set();
+        }
+        return cluster;
+    }
+
+    // Add ad to the cluster as a new job; requires an open queue connection.
+    void sendProc(ConnectionSentry &sentry, int cluster, ClassAd &ad)
+    {
+        sentry.check();
+        int procid;
+        std::string failed_attr;
+        // Release the GIL while talking to the schedd, so cancel() can be
+        // called from another thread.
+        Py_BEGIN_ALLOW_THREADS
+        QueueConnection &queue = sentry.queue();
+        procid = queue.newProc(cluster);
+        if (procid >= 0)
+        {
+            ad.InsertAttr(ATTR_CLUSTER_ID, cluster);
+            ad.InsertAttr(ATTR_PROC_ID, procid);
+
+            classad::ClassAdUnParser unparser;
+            unparser.SetOldClassAd( true );
+            for (classad::ClassAd::const_iterator it = ad.begin(); it != ad.end(); it++)
+            {
+                std::string rhs;
+                unparser.Unparse(rhs, it->second);
+                if (-1 == queue.setAttribute(cluster, procid, it->first.c_str(), rhs.c_str(), SetAttribute_NoAck))
+                {
+                    failed_attr = it->first;
+                    break;
+                }
+            }
+        }
+        Py_END_ALLOW_THREADS
+        if (procid < 0)
+        {
+            sentry.check();
+            PyErr_SetString(PyExc_RuntimeError, "Failed to create new proc id.");
+            throw_error_already_set();
+        }
+        if (failed_attr.size())
+        {
+            sentry.check();
+            PyErr_SetString(PyExc_ValueError, failed_attr.c_str());
+            throw_error_already_set();
+        }
+    }
+
+    // The queue connection of one call; each call gets its own, so calls
+    // from several threads do not interfere.  See QueueConnection.
     struct ConnectionSentry
     {
     public:
-        ConnectionSentry(Schedd &schedd) : m_connected(false)
+        ConnectionSentry(Schedd &schedd, Deadline &deadline) : m_deadline(deadline)
         {
-            if (ConnectQ(schedd.m_addr.c_str(), 0, false, NULL, NULL, schedd.m_version.c_str()) == 0)
+            bool connected;
+            Py_BEGIN_ALLOW_THREADS
+            connected = m_queue.connect(schedd.m_addr, schedd.m_version, deadline.remaining());
+            Py_END_ALLOW_THREADS
+            if (!connected)
             {
+                m_deadline.check(true);
                 PyErr_SetString(PyExc_RuntimeError, "Failed to connect to schedd.");
                 throw_error_already_set();
             }
-            m_connected = true;
         }
 
-        void disconnect()
+        QueueConnection &queue() { return m_queue; }
+
+        // If the call was interrupted, drop the connection without
+        // committing, then raise.
+        void check()
         {
-            if (m_connected && !DisconnectQ(NULL))
+            if (m_deadline.poll())
+            {
+                abort();
+                m_deadline.check();
+            }
+        }
+
+        // Drop the connection, discarding the open transaction.  Never throws.
+        void abort()
+        {
+            if (!m_queue.connected())
+                return;
+            Py_BEGIN_ALLOW_THREADS
+            m_queue.disconnect(false);
+            Py_END_ALLOW_THREADS
+        }
+
+        // Commit and disconnect; only on the normal return path.
+        void commit()
+        {
+            check();
+            bool committed;
+            Py_BEGIN_ALLOW_THREADS
+            committed = m_queue.disconnect(true);
+            Py_END_ALLOW_THREADS
+            if (!committed)
             {
-                m_connected = false;
                 PyErr_SetString(PyExc_RuntimeError, "Failed to commmit and disconnect from queue.");
                 throw_error_already_set();
             }
-            m_connected = false;
         }
 
+        // Any exception, including one raised halfway through a job's
+        // attributes, leaves the transaction uncommitted.
         ~ConnectionSentry()
         {
-            disconnect();
+            abort();
         }
     private:
-        bool m_connected;
+        QueueConnection m_queue;
+        Deadline &m_deadline;
     };
 
     std::string m_addr, m_name, m_version;
+    Canceller m_canceller;
 };
 
-BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(query_overloads, query, 0, 2);
-BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(submit_overloads, submit, 1, 2);
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(query_overloads, query, 0, 5);
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(act_overloads, actOnJobs, 2, 4);
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(submit_overloads, submit, 1, 3);
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(submit_many_overloads, submitMany, 1, 3);
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(edit_overloads, edit, 3, 4);
 
 void export_schedd()
 {
@@ -378,25 +1086,62 @@ void export_schedd()
         .value("Continue", JA_CONTINUE_JOBS)
         ;
 
-    class_<Schedd>("Schedd", "A client class for the HTCondor schedd")
+    class_<Schedd, boost::noncopyable>("Schedd", "A client class for the HTCondor schedd")
         .def(init<const ClassAdWrapper &>(":param ad: An ad containing the location of the schedd"))
-        .def("query", &Schedd::query, query_overloads("Query the HTCondor schedd for jobs.\n"
+        .def("query", &Schedd::query, query_overloads(args("constraint", "attr_list", "timeout", "shards", "lazy"), "Query the HTCondor schedd for jobs.\n"
             ":param constraint: An optional constraint for filtering out jobs; defaults to 'true'\n"
             ":param attr_list: A list of attributes for the schedd to project along.  Defaults to having the schedd return all attributes.\n"
+            ":param timeout: Seconds allowed for the whole query; if not specified, there is no limit.\n"
+            ":param shards: For large queues, the number of ClusterId ranges fetched and decoded concurrently over separate connections; "
+            "results are returned in ClusterId range order.  Defaults to 1; ignored while recording or replaying responses.\n"
+            ":param lazy: When set to true, each job's attributes are decoded only when first accessed.  "
+            "Ignored when shards is more than 1.\n"
             ":return: A list of matching jobs, containing the requested attributes."))
-        .def("act", &Schedd::actOnJobs2)
-        .def("act", &Schedd::actOnJobs, "Change status of job(s) in the schedd.\n"
+        .def("act", &Schedd::actOnJobs, act_overloads(args("action", "job_spec", "reason", "timeout"), "Change status of job(s) in the schedd.\n"
             ":param action: Action to perform; must be from enum JobAction.\n"
             ":param job_spec: Job specification; can either be a list of job IDs or a string specifying a constraint to match jobs.\n"
-            ":return: Number of jobs changed.")
-        .def("submit", &Schedd::submit, submit_overloads("Submit one or more jobs to the HTCondor schedd.\n"
+            ":param reason: Reason for the action; for Hold, may be a (hold string, hold code) tuple.\n"
+            ":param timeout: Seconds allowed for the action; if not specified, there is no limit.  The action runs in a worker process, "
+            "which is abandoned when the time is up, on cancel() or on KeyboardInterrupt; the action may or may not have taken effect then.\n"
+            ":return: Number of jobs changed."))
+        .def("submit", &Schedd::submit, submit_overloads(args("ad", "count", "timeout"), "Submit one or more jobs to the HTCondor schedd.\n"
             ":param ad: ClassAd describing job cluster.\n"
             ":param count: Number of jobs to submit to cluster.\n"
-            ":return: Newly created cluster ID."))
-        .def("edit", &Schedd::edit, "Edit one or more jobs in the queue.\n"
+            ":param timeout: Seconds allowed for the submission; if the time runs out, the transaction is aborted.\n"
+            ":return: Newly created cluster ID.\n"
+            "Each call uses its own queue connection, so several threads may submit or edit at once."))
+        .def("submitMany", &Schedd::submitMany, submit_many_overloads(args("jobs", "batch_size", "timeout"), "Submit a stream of jobs over a single queue connection, one job per ad.\n"
+            ":param jobs: An iterable of ClassAds or ClassAd strings, a file object, or the name of a file containing new-style ClassAds.  "
+            "Ads are read and submitted one at a time, so memory use does not grow with the number of jobs.\n"
+            ":param batch_size: Number of jobs placed in each cluster; the queue transaction is committed after each batch.  Defaults to 1000.\n"
+            ":param timeout: Seconds allowed for the whole submission.\n"
+            ":return: A list of the newly created cluster IDs.\n"
+            "If the time runs out, or reading or sending an ad fails, the uncommitted batch is aborted; earlier batches stay committed."))
+        .def("edit", &Schedd::edit, edit_overloads(args("job_spec", "attr", "value", "timeout"), "Edit one or more jobs in the queue.\n"
             ":param job_spec: Either a list of jobs (CLUSTER.PROC) or a string containing a constraint to match jobs against.\n"
             ":param attr: Attribute name to edit.\n"
-            ":param value: The new value of the job attribute; should be a string (which will be converted to a ClassAds expression) or a ClassAds expression.");
+            ":param value: The new value of the job attribute; should be a string (which will be converted to a ClassAds expression) or a ClassAds expression.\n"
+            ":param timeout: Seconds allowed for the edit; if the time runs out, uncommitted changes are aborted."))
+        .def("cancel", &Schedd::cancel, "Interrupt the operation in progress on this object, from another thread.\n"
+            "The interrupted call raises IOError; queries return no partial results and uncommitted changes are aborted.\n"
+            "A call still connecting to the schedd stops only once the connection attempt ends, after the timeout or QUERY_TIMEOUT seconds.")
+        ;
+
+    class_<PoolQuery, boost::noncopyable>("PoolQuery", "Query the jobs of many schedds concurrently.\n"
+            "Iterating over the object yields (schedd name, job ad) tuples as schedds respond.",
+            init<list, optional<std::string, list, int, int, int> >(
+            ":param schedd_ads: A list of schedd ads, such as the result of Collector.locateAll(DaemonTypes.Schedd).\n"
+            ":param constraint: An optional constraint for filtering out jobs; defaults to 'true'.\n"
+            ":param attr_list: A list of attributes for the schedds to project along.  Defaults to all attributes.\n"
+            ":param parallelism: Maximum number of schedds queried at once; defaults to 8.\n"
+            ":param timeout: Seconds after which a schedd is abandoned; defaults to 60.\n"
+            ":param slow_threshold: Schedds taking at least this many seconds are reported as slow; defaults to 10."))
+        .def("__iter__", pass_through)
+        .def("next", &PoolQuery::next)
+        .add_property("failures", &PoolQuery::failures, "A dictionary of schedd names to the reason the query failed.  "
+            "Jobs received from a schedd before it failed are still returned.")
+        .add_property("durations", &PoolQuery::durations, "A dictionary of schedd names to the seconds each query took.")
+        .add_property("slow", &PoolQuery::slow, "A list of schedds that took at least slow_threshold seconds.")
         ;
 }
 
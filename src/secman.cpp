@@ -10,6 +10,9 @@
 
 #include "condor_secman.h"
 
+#include "module_lock.h"
+#include "lazy_config.h"
+
 using namespace boost::python;
 
 struct SecManWrapper
@@ -20,6 +23,8 @@ public:
     void
     invalidateAllCache()
     {
+        ensure_config();
+        ModuleLock lock;
         m_secman.invalidateAllCache();
     }
 
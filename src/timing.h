@@ -0,0 +1,16 @@
+
+#ifndef __TIMING_H_
+#define __TIMING_H_
+
+#include <sys/time.h>
+
+// Wall-clock time in seconds, with microsecond resolution.
+inline double
+now_seconds()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+#endif
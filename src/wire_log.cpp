@@ -0,0 +1,209 @@
+
+#include "condor_common.h"
+#include "condor_config.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/file.h>
+
+#include <sstream>
+#include <boost/python.hpp>
+
+#include "module_lock.h"
+#include "wire_log.h"
+
+#define WIRE_LOG_MAGIC "PYCWIRE1"
+
+struct RecordHeader
+{
+    char magic[8];
+    uint32_t key_length;
+    uint32_t ad_count;
+    uint64_t data_length;
+};
+
+struct AdHeader
+{
+    uint32_t text_length;
+    uint32_t my_type_length;
+    uint32_t target_type_length;
+};
+
+// Passes each ad on to the real sink, keeping a copy for the log.
+class WireLog::Recorder : public QuerySink
+{
+public:
+    Recorder(QuerySink &sink) : m_sink(sink), m_count(0) {}
+
+    bool put(WireAd &ad)
+    {
+        AdHeader header;
+        header.text_length = ad.text.size();
+        header.my_type_length = ad.my_type.size();
+        header.target_type_length = ad.target_type.size();
+        m_data.append(reinterpret_cast<const char *>(&header), sizeof(header));
+        m_data += ad.text;
+        m_data += ad.my_type;
+        m_data += ad.target_type;
+        m_count++;
+        return m_sink.put(ad);
+    }
+
+    void clear()
+    {
+        m_data.clear();
+        m_count = 0;
+        m_sink.clear();
+    }
+
+    QuerySink &m_sink;
+    std::string m_data;
+    uint32_t m_count;
+};
+
+WireLog::WireLog(const std::string &key)
+  : m_key(key), m_missing(false)
+{
+    ModuleLock lock;
+    param(m_replay_path, "PYTHON_WIRE_REPLAY");
+    if (m_replay_path.empty())
+        param(m_record_path, "PYTHON_WIRE_RECORD");
+}
+
+WireLog::~WireLog()
+{
+}
+
+std::string
+WireLog::collectorKey(const std::string &pool, AdTypes ad_type, const std::string &constraint,
+    const std::vector<std::string> &attrs)
+{
+    std::stringstream key;
+    key << "collector\n" << pool << '\n' << ad_type << '\n' << constraint << '\n';
+    for (std::vector<std::string>::const_iterator it = attrs.begin(); it != attrs.end(); it++)
+        key << *it << ',';
+    return key.str();
+}
+
+std::string
+WireLog::scheddKey(const std::string &name, const std::string &constraint, const std::vector<std::string> &attrs)
+{
+    std::stringstream key;
+    key << "schedd\n" << name << '\n' << constraint << '\n';
+    for (std::vector<std::string>::const_iterator it = attrs.begin(); it != attrs.end(); it++)
+        key << *it << ',';
+    return key.str();
+}
+
+QuerySink &
+WireLog::wrap(QuerySink &sink)
+{
+    if (m_record_path.empty())
+        return sink;
+    m_recorder.reset(new Recorder(sink));
+    return *m_recorder;
+}
+
+void
+WireLog::commit()
+{
+    if (!m_recorder.get())
+        return;
+    RecordHeader header;
+    memcpy(header.magic, WIRE_LOG_MAGIC, sizeof(header.magic));
+    header.key_length = m_key.size();
+    header.ad_count = m_recorder->m_count;
+    header.data_length = m_recorder->m_data.size();
+    std::string contents(reinterpret_cast<const char *>(&header), sizeof(header));
+    contents += m_key;
+    contents += m_recorder->m_data;
+    std::string().swap(m_recorder->m_data);
+
+    int fd = open(m_record_path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0600);
+    if (fd < 0)
+        return;
+    // Keep records from concurrent processes whole.
+    flock(fd, LOCK_EX);
+    const char *pos = contents.c_str();
+    size_t remaining = contents.size();
+    while (remaining)
+    {
+        ssize_t written = write(fd, pos, remaining);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            break;
+        pos += written;
+        remaining -= written;
+    }
+    close(fd);
+}
+
+static bool
+read_string(FILE *fp, size_t length, std::string &str)
+{
+    str.resize(length);
+    return !length || (fread(&str[0], length, 1, fp) == 1);
+}
+
+QueryResult
+WireLog::replay(QuerySink &sink)
+{
+    m_missing = true;
+    FILE *fp = fopen(m_replay_path.c_str(), "r");
+    if (!fp)
+        return Q_COMMUNICATION_ERROR;
+
+    // The last complete record for the key wins; a truncated tail is ignored.
+    off_t size = (fseeko(fp, 0, SEEK_END) == 0) ? ftello(fp) : -1;
+    rewind(fp);
+    off_t found = -1;
+    uint32_t found_count = 0;
+    RecordHeader header;
+    std::string key;
+    while (fread(&header, sizeof(header), 1, fp) == 1)
+    {
+        if (memcmp(header.magic, WIRE_LOG_MAGIC, sizeof(header.magic)) || !read_string(fp, header.key_length, key))
+            break;
+        off_t data = ftello(fp);
+        if ((data + static_cast<off_t>(header.data_length) > size) || fseeko(fp, header.data_length, SEEK_CUR))
+            break;
+        if (key == m_key)
+        {
+            found = data;
+            found_count = header.ad_count;
+        }
+    }
+
+    bool ok = (found >= 0) && !fseeko(fp, found, SEEK_SET);
+    for (uint32_t idx=0; ok && (idx<found_count); idx++)
+    {
+        AdHeader ad_header;
+        WireAd ad;
+        ok = (fread(&ad_header, sizeof(ad_header), 1, fp) == 1)
+            && read_string(fp, ad_header.text_length, ad.text)
+            && read_string(fp, ad_header.my_type_length, ad.my_type)
+            && read_string(fp, ad_header.target_type_length, ad.target_type)
+            && sink.put(ad);
+    }
+    fclose(fp);
+    if (!ok)
+    {
+        sink.clear();
+        return Q_COMMUNICATION_ERROR;
+    }
+    m_missing = false;
+    return Q_OK;
+}
+
+void
+WireLog::check()
+{
+    if (m_missing)
+    {
+        std::string message = "No recorded response for this query in " + m_replay_path + ".";
+        PyErr_SetString(PyExc_IOError, message.c_str());
+        boost::python::throw_error_already_set();
+    }
+}
@@ -0,0 +1,59 @@
+
+#ifndef __WIRE_LOG_H_
+#define __WIRE_LOG_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/noncopyable.hpp>
+
+#include "collector_query.h"
+
+/*
+ * Records query responses as they come off the wire, or replays them in
+ * place of the network, so the decode path can be profiled offline against
+ * data from a production pool.
+ *
+ * When PYTHON_WIRE_RECORD names a file, every Collector.query and
+ * Schedd.query response read successfully is appended to it, keyed by the
+ * query.  When PYTHON_WIRE_REPLAY names such a file, the same queries are
+ * answered from the last matching response in it, without contacting any
+ * daemon.
+ */
+class WireLog : boost::noncopyable
+{
+public:
+    WireLog(const std::string &key);
+    ~WireLog();
+
+    bool replaying() const { return m_replay_path.size(); }
+    bool active() const { return replaying() || m_record_path.size(); }
+
+    // Without the GIL: feed the recorded response to sink.
+    QueryResult replay(QuerySink &sink);
+
+    // The sink to read the network response into; records it if needed.
+    QuerySink &wrap(QuerySink &sink);
+
+    // Without the GIL, once the response has been read: record it.
+    void commit();
+
+    // With the GIL: raise IOError if replay() found no recorded response.
+    void check();
+
+    static std::string collectorKey(const std::string &pool, AdTypes ad_type,
+        const std::string &constraint, const std::vector<std::string> &attrs);
+    static std::string scheddKey(const std::string &name, const std::string &constraint,
+        const std::vector<std::string> &attrs);
+
+private:
+    class Recorder;
+
+    std::string m_key;
+    std::string m_record_path;
+    std::string m_replay_path;
+    bool m_missing;
+    std::auto_ptr<Recorder> m_recorder;
+};
+
+#endif
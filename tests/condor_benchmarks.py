@@ -0,0 +1,209 @@
+#!/usr/bin/python
+
+import os
+import sys
+import time
+import shutil
+import subprocess
+import condor
+import classad
+import unittest
+import threading
+
+from condor_tests import TestWithDaemons
+
+# Number of ads used by the benchmarks; override with BENCHMARK_ADS.
+def benchmark_ads():
+    return int(os.environ.get("BENCHMARK_ADS", "20000"))
+
+def resident_kb():
+    for line in open("/proc/self/status").readlines():
+        if line.startswith("VmRSS:"):
+            return int(line.split()[1])
+    return 0
+
+def report(name, value, unit):
+    print >> sys.stderr, "\nBENCHMARK %s: %.2f %s" % (name, value, unit)
+
+def make_startd_like_ads(count):
+    ads = []
+    for i in range(count):
+        ads.append(classad.ClassAd('[MyType="GenericAd"; Name="slot%d@bench"; Arch="X86_64"; OpSys="LINUX"; '
+            'State="Unclaimed"; Activity="Idle"; FileSystemDomain="hcc-briantest.unl.edu"; '
+            'Owner="bbockelm"; Memory=%d; Disk=%d]' % (i, 1024 + i % 4, 100000 + i)))
+    return ads
+
+# Give a sleep job the attributes of a typical user job.
+def benchmark_job(ad):
+    ad.update(classad.ClassAd('[Environment="BENCHMARK=1"; Requirements=TARGET.Arch == "X86_64"; RequestMemory=1024]'))
+    return ad
+
+class BenchmarkImport(unittest.TestCase):
+
+    def time_python(self, code, env, runs=20):
+        full_env = dict(os.environ)
+        full_env.update(env)
+        starttime = time.time()
+        for i in range(runs):
+            self.assertEquals(subprocess.call([sys.executable, "-c", code], env=full_env), 0)
+        return (time.time() - starttime) / runs
+
+    def testImportTime(self):
+        report("interpreter startup", self.time_python("pass", {}), "s")
+        report("import condor", self.time_python("import condor", {}), "s")
+        report("import condor, read a knob", self.time_python("import condor; condor.param['COLLECTOR_HOST']", {}), "s")
+        report("import condor, read a knob, minimal config", self.time_python("import condor; condor.param['COLLECTOR_HOST']",
+            {"_condor_PYTHON_MINIMAL_CONFIG": "true", "_condor_COLLECTOR_HOST": "localhost"}), "s")
+
+class BenchmarkQueries(TestWithDaemons):
+
+    def advertise_ads(self, count):
+        self.launch_daemons(["COLLECTOR"])
+        coll = condor.Collector()
+        ads = make_startd_like_ads(count)
+        for i in range(0, count, 1000):
+            coll.advertise(ads[i:i+1000], "UPDATE_AD_GENERIC", True)
+        for i in range(10):
+            if len(coll.query(condor.AdTypes.Any, 'Owner =?= "bbockelm"', ["Name"])) == count:
+                break
+            time.sleep(1)
+        return coll
+
+    def query_memory(self, coll, count):
+        before = resident_kb()
+        starttime = time.time()
+        results = coll.query(condor.AdTypes.Any, 'Owner =?= "bbockelm"')
+        elapsed = time.time() - starttime
+        self.assertEquals(len(results), count)
+        # Return the results so the caller keeps them resident for the next measurement.
+        return results, 1024.0*(resident_kb() - before) / count, elapsed
+
+    def testQueryInternedStrings(self):
+        count = benchmark_ads()
+        coll = self.advertise_ads(count)
+        with self.config(PYTHON_INTERN_QUERY_STRINGS="false"):
+            plain, plain_bytes, plain_time = self.query_memory(coll, count)
+        with self.config(PYTHON_INTERN_QUERY_STRINGS="true"):
+            interned, interned_bytes, interned_time = self.query_memory(coll, count)
+        report("resident bytes per ad, copied strings", plain_bytes, "bytes")
+        report("resident bytes per ad, interned strings", interned_bytes, "bytes")
+        report("query time, copied strings", plain_time, "s")
+        report("query time, interned strings", interned_time, "s")
+
+    def testQueryLazy(self):
+        count = benchmark_ads()
+        coll = self.advertise_ads(count)
+        for lazy in [False, True]:
+            before = resident_kb()
+            starttime = time.time()
+            results = coll.query(condor.AdTypes.Any, 'Owner =?= "bbockelm"', lazy=lazy)
+            names = [ad["Name"] for ad in results]
+            elapsed = time.time() - starttime
+            self.assertEquals(len(names), count)
+            mode = lazy and "lazy" or "eager"
+            report("query and read Name, %s ads" % mode, elapsed, "s")
+            report("resident bytes per ad, %s ads" % mode, 1024.0*(resident_kb() - before) / count, "bytes")
+            del results
+
+    def testQueryDecodeThreads(self):
+        count = benchmark_ads()
+        coll = self.advertise_ads(count)
+        for threads in [1, 2, 4, 8]:
+            with self.config(PYTHON_QUERY_DECODE_THREADS=threads):
+                starttime = time.time()
+                self.assertEquals(len(coll.query(condor.AdTypes.Any, 'Owner =?= "bbockelm"')), count)
+                report("query rate, %d decode thread(s)" % threads, count / (time.time() - starttime), "ads/s")
+
+    def testReplayDecode(self):
+        count = benchmark_ads()
+        coll = self.advertise_ads(count)
+        record_file = os.path.join(os.getcwd(), "tests_tmp", "bench_wire.log")
+        if os.path.exists(record_file): os.unlink(record_file)
+        with self.config(PYTHON_WIRE_RECORD=record_file):
+            self.assertEquals(len(coll.query(condor.AdTypes.Any, 'Owner =?= "bbockelm"')), count)
+        with self.config(PYTHON_WIRE_REPLAY=record_file):
+            for lazy in [False, True]:
+                starttime = time.time()
+                self.assertEquals(len(coll.query(condor.AdTypes.Any, 'Owner =?= "bbockelm"', lazy=lazy)), count)
+                report("replayed query rate, %s ads" % (lazy and "lazy" or "eager"), count / (time.time() - starttime), "ads/s")
+
+    def testQueryCacheReload(self):
+        count = benchmark_ads()
+        coll = self.advertise_ads(count)
+        cache_dir = os.path.join(os.getcwd(), "tests_tmp", "query_cache")
+        shutil.rmtree(cache_dir, True)
+        with self.config(PYTHON_QUERY_CACHE_DIR=cache_dir, PYTHON_QUERY_CACHE_TTL=600):
+            starttime = time.time()
+            self.assertEquals(len(coll.query(condor.AdTypes.Any, 'Owner =?= "bbockelm"')), count)
+            miss_time = time.time() - starttime
+            starttime = time.time()
+            self.assertEquals(len(coll.query(condor.AdTypes.Any, 'Owner =?= "bbockelm"')), count)
+            hit_time = time.time() - starttime
+        report("query time, collector and snapshot write", miss_time, "s")
+        report("query time, snapshot reload", hit_time, "s")
+
+class BenchmarkAdvertise(TestWithDaemons):
+
+    def testAdvertiseModes(self):
+        count = benchmark_ads()
+        self.launch_daemons(["COLLECTOR"])
+        coll = condor.Collector()
+        ads = [classad.ClassAd('[MyType="Machine"; Name="slot%d@bench"; Machine="bench"; MyAddress="<127.0.0.1:9618>"; '
+            'Arch="X86_64"; OpSys="LINUX"; State="Unclaimed"; Activity="Idle"; Memory=%d]' % (i, 1024 + i % 4)) for i in range(count)]
+        modes = [("UDP", "UPDATE_STARTD_AD", False, None),
+                 ("TCP", "UPDATE_STARTD_AD", True, None),
+                 ("ack, window 1", "UPDATE_STARTD_AD_WITH_ACK", True, "1"),
+                 ("ack, window 32", "UPDATE_STARTD_AD_WITH_ACK", True, "32")]
+        for name, command, use_tcp, window in modes:
+            with self.config(PYTHON_ADVERTISE_ACK_WINDOW=window or 1):
+                starttime = time.time()
+                coll.advertise(ads, command, use_tcp)
+                elapsed = time.time() - starttime
+            # Only acknowledged updates are known to have arrived.
+            received = len(coll.query(condor.AdTypes.Startd, 'Machine =?= "bench"', ["Name"]))
+            report("advertise rate, %s" % name, count / elapsed, "ads/s")
+            report("ads in collector after advertise, %s" % name, received, "ads")
+
+class BenchmarkScheddQueries(TestWithDaemons):
+
+    def submit_jobs(self, count):
+        schedd = self.launch_schedd()
+        schedd.submitMany((benchmark_job(self.sleep_job(Idx=i)) for i in xrange(count)), 100)
+        return schedd
+
+    def testQueryShards(self):
+        count = benchmark_ads()
+        schedd = self.submit_jobs(count)
+        for shards in [1, 2, 4]:
+            starttime = time.time()
+            self.assertEquals(len(schedd.query("Idx =!= undefined", [], 0, shards)), count)
+            report("schedd query time, %d shard(s)" % shards, time.time() - starttime, "s")
+
+    def testQueryDecodeThreads(self):
+        count = benchmark_ads()
+        schedd = self.submit_jobs(count)
+        for threads in [1, 2, 4, 8]:
+            with self.config(PYTHON_QUERY_DECODE_THREADS=threads):
+                starttime = time.time()
+                self.assertEquals(len(schedd.query("Idx =!= undefined")), count)
+                report("schedd query rate, %d decode thread(s)" % threads, count / (time.time() - starttime), "ads/s")
+
+class BenchmarkScheddSubmit(TestWithDaemons):
+
+    def testConcurrentSubmit(self):
+        count = benchmark_ads()
+        schedd = self.launch_schedd()
+        ad = benchmark_job(self.sleep_job())
+        for threads in [1, 2, 4, 8]:
+            # Each thread submits its share as clusters of 10 jobs, one transaction each.
+            def submit():
+                for i in range(count / threads / 10):
+                    schedd.submit(ad, 10)
+            workers = [threading.Thread(target=submit) for i in range(threads)]
+            starttime = time.time()
+            for worker in workers: worker.start()
+            for worker in workers: worker.join()
+            report("submit rate, %d thread(s)" % threads, count / (time.time() - starttime), "jobs/s")
+
+if __name__ == '__main__':
+    unittest.main()
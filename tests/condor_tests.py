@@ -2,12 +2,36 @@
 
 import os
 import re
+import sys
 import time
 import condor
+import pwd
 import errno
 import signal
+import shutil
+import socket
+import subprocess
 import classad
 import unittest
+import threading
+import contextlib
+
+def run_python(code, env):
+    full_env = dict(os.environ)
+    full_env.update(env)
+    return subprocess.Popen([sys.executable, "-c", code], env=full_env, stdout=subprocess.PIPE).communicate()[0]
+
+class TestLazyConfig(unittest.TestCase):
+
+    def test_import_without_config(self):
+        # Importing must not read the (here unreadable) configuration.
+        output = run_python("import condor; print condor.version()", {"CONDOR_CONFIG": "/nonexistent"})
+        self.assertTrue(output.startswith("$CondorVersion"))
+
+    def test_minimal_config(self):
+        output = run_python("import condor; print condor.param['FOO']",
+            {"CONDOR_CONFIG": "/nonexistent", "_condor_PYTHON_MINIMAL_CONFIG": "true", "_condor_FOO": "BAR"})
+        self.assertEquals(output.strip(), "BAR")
 
 class TestConfig(unittest.TestCase):
 
@@ -41,6 +65,21 @@ class TestVersion(unittest.TestCase):
     def test_platform(self):
         self.assertEquals(condor.platform(), self.lines[1])
 
+class TestMatchAnalysis(unittest.TestCase):
+
+    def test_analyze(self):
+        job = classad.ClassAd('[ClusterId=1; ProcId=0; RequestMemory=2048; Requirements=(TARGET.Memory >= RequestMemory) && (TARGET.Arch == "X86_64"); Rank=TARGET.Memory]')
+        slots = [classad.ClassAd('[Name="slot%d@host"; Memory=%d; Arch="%s"; Requirements=true]' % (i, 1024*(i%4), i%2 and "X86_64" or "INTEL")) for i in range(40)]
+        for threads in [1, 3]:
+            result = condor.analyzeMatches([job], slots, threads)[0]
+            self.assertEquals(result["ClusterId"], 1)
+            self.assertEquals(result["MatchingSlots"], 10)
+            self.assertEquals(result["SlotRequirementsMatch"], 40)
+            self.assertTrue("RequestMemory" in result["MostRejectingClause"])
+            self.assertEquals(result["BestRank"], 3072)
+            self.assertEquals(result["BestSlot"], "slot3@host")
+            self.assertEquals(result["MostRejectingCount"], 20)
+
 def makedirs_ignore_exist(directory):
     try:
         os.makedirs(directory)
@@ -100,9 +139,14 @@ class TestWithDaemons(unittest.TestCase):
             self.waitLocalDaemon(daemon)
 
     def tearDown(self):
+        self.stop_daemons()
+
+    def stop_daemons(self):
+        """Shut down the master and its daemons, waiting for them to exit."""
         if self.pid > 1:
             os.kill(self.pid, signal.SIGQUIT)
             pid, exit_status = os.waitpid(self.pid, 0)
+            self.pid = -1
             self.assertTrue(os.WIFEXITED(exit_status))
             code = os.WEXITSTATUS(exit_status)
             self.assertEquals(code, 0)
@@ -116,6 +160,40 @@ class TestWithDaemons(unittest.TestCase):
         if not os.path.exists(address_file):
             raise RuntimeError("Waiting for daemon %s timed out." % daemon)
 
+    @contextlib.contextmanager
+    def config(self, **knobs):
+        """Set configuration knobs, as _condor_ environment variables, for the duration of a with block."""
+        saved = {}
+        for knob, value in knobs.items():
+            var = "_condor_" + knob
+            saved[var] = os.environ.get(var)
+            os.environ[var] = str(value)
+        condor.reload_config()
+        try:
+            yield
+        finally:
+            for var, value in saved.items():
+                if value is None:
+                    del os.environ[var]
+                else:
+                    os.environ[var] = value
+            condor.reload_config()
+
+    def launch_schedd(self):
+        """Start a schedd and a collector; returns a Schedd for the new schedd, whose ad is kept in self.schedd_ad."""
+        self.launch_daemons(["SCHEDD", "COLLECTOR"])
+        name = "%s@%s" % (condor.param["SCHEDD_NAME"], condor.param["CONDOR_HOST"])
+        self.schedd_ad = self.waitRemoteDaemon(condor.DaemonTypes.Schedd, name, timeout=10)
+        return condor.Schedd(self.schedd_ad)
+
+    def sleep_job(self, **attrs):
+        """A held sleep job owned by the current user, with the given extra attributes."""
+        ad = classad.ClassAd('[Cmd="/bin/sleep"; Arguments="60"; Iwd="/tmp"; JobUniverse=5; JobStatus=5]')
+        ad["Owner"] = pwd.getpwuid(os.geteuid()).pw_name
+        for attr, value in attrs.items():
+            ad[attr] = value
+        return ad
+
     def waitRemoteDaemon(self, dtype, dname, pool=None, timeout=5):
         if pool:
             coll = condor.Collector(pool)
@@ -146,12 +224,166 @@ class TestWithDaemons(unittest.TestCase):
         remote_ad = self.waitRemoteDaemon(condor.DaemonTypes.Collector, "%s@%s" % (condor.param["COLLECTOR_NAME"], condor.param["CONDOR_HOST"]))
         self.assertEquals(remote_ad["MyAddress"], coll_ad["MyAddress"])
 
+    def testMinimalConfigQuery(self):
+        self.launch_daemons(["COLLECTOR"])
+        self.waitRemoteDaemon(condor.DaemonTypes.Collector, "%s@%s" % (condor.param["COLLECTOR_NAME"], condor.param["CONDOR_HOST"]))
+        code = "import os, condor; print len(condor.Collector(os.environ['_condor_COLLECTOR_HOST']).query(condor.AdTypes.Collector, 'true', ['Name']))"
+        output = run_python(code, {"_condor_PYTHON_MINIMAL_CONFIG": "true", "_condor_COLLECTOR_HOST": condor.param["COLLECTOR_HOST"]})
+        self.assertEquals(output.strip(), "1")
+
     def testScheddLocate(self):
-        self.launch_daemons(["SCHEDD", "COLLECTOR"])
-        coll = condor.Collector()
+        self.launch_schedd()
         name = "%s@%s" % (condor.param["SCHEDD_NAME"], condor.param["CONDOR_HOST"])
-        schedd_ad = self.waitRemoteDaemon(condor.DaemonTypes.Schedd, name, timeout=10)
-        self.assertEquals(schedd_ad["Name"], name)
+        self.assertEquals(self.schedd_ad["Name"], name)
+
+    def testPoolQuery(self):
+        self.launch_schedd()
+        name = self.schedd_ad["Name"]
+        bogus_ad = classad.ClassAd('[Name="bogus"; ScheddIpAddr="<127.0.0.1:1>"]')
+        query = condor.PoolQuery([self.schedd_ad, bogus_ad], "true", ["ClusterId", "ProcId"], 2, 20)
+        for schedd_name, job in query:
+            self.assertEquals(schedd_name, name)
+            self.assertTrue("ClusterId" in job)
+        self.assertTrue(name in query.durations)
+        self.assertTrue(name not in query.failures)
+        self.assertTrue("bogus" in query.failures)
+
+    def testSubmitMany(self):
+        schedd = self.launch_schedd()
+        ads = [self.sleep_job(Idx=i) for i in range(3)]
+        clusters = schedd.submitMany(ads, 2)
+        self.assertEquals(len(clusters), 2)
+        jobs = schedd.query("ClusterId == %d || ClusterId == %d" % tuple(clusters), ["ClusterId", "ProcId", "Idx"])
+        self.assertEquals(sorted([j["Idx"] for j in jobs]), [0, 1, 2])
+        job_file = os.path.join(os.getcwd(), "tests_tmp", "jobs.ads")
+        fd = open(job_file, "w")
+        for i in range(3, 6):
+            fd.write(str(self.sleep_job(Idx=i)) + "\n")
+        fd.close()
+        clusters = schedd.submitMany(job_file)
+        self.assertEquals(len(clusters), 1)
+        self.assertEquals(len(schedd.query("ClusterId == %d" % clusters[0], ["ProcId"])), 3)
+        clusters = schedd.submitMany(open(job_file), 1)
+        self.assertEquals(len(clusters), 3)
+
+    def testSubmitManyAbortsOnError(self):
+        schedd = self.launch_schedd()
+        # The first batch is committed; the malformed ad aborts the second.
+        ads = [str(self.sleep_job(Partial=i)) for i in range(3)] + ['[Cmd = ]', str(self.sleep_job(Partial=3))]
+        self.assertRaises(SyntaxError, schedd.submitMany, ads, 2)
+        jobs = schedd.query("Partial =!= undefined", ["Partial"])
+        self.assertEquals(sorted([j["Partial"] for j in jobs]), [0, 1])
+
+    def testConcurrentSubmit(self):
+        schedd = self.launch_schedd()
+        clusters = []
+        def submit(i):
+            for j in range(5):
+                clusters.append(schedd.submit(self.sleep_job(Thread=i), 2))
+        threads = [threading.Thread(target=submit, args=(i,)) for i in range(4)]
+        for thread in threads: thread.start()
+        for thread in threads: thread.join()
+        self.assertEquals(len(set(clusters)), 20)
+        jobs = schedd.query("Thread =!= undefined", ["ClusterId", "Thread"])
+        self.assertEquals(len(jobs), 40)
+        schedd.edit("Thread =!= undefined", "Edited", "true")
+        self.assertEquals(len(schedd.query("Edited =?= true", ["ClusterId"])), 40)
+
+    def testDeadlines(self):
+        self.launch_daemons(["COLLECTOR"])
+        coll = condor.Collector()
+        self.assertTrue(coll.query(condor.AdTypes.Collector, "true", [], timeout=10))
+        # A listener that accepts connections but never answers.
+        silent = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        silent.bind(("127.0.0.1", 0))
+        silent.listen(5)
+        silent_coll = condor.Collector("127.0.0.1:%d" % silent.getsockname()[1])
+        start = time.time()
+        self.assertRaises(IOError, silent_coll.query, condor.AdTypes.Any, "true", [], 2)
+        self.assertTrue(time.time() - start < 10)
+        canceller = threading.Timer(1, silent_coll.cancel)
+        canceller.start()
+        start = time.time()
+        self.assertRaises(IOError, silent_coll.query)
+        self.assertTrue(time.time() - start < 10)
+        canceller.join()
+        silent.close()
+
+    def testScheddDeadlines(self):
+        # A schedd address that accepts connections but never answers.
+        silent = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        silent.bind(("127.0.0.1", 0))
+        silent.listen(5)
+        schedd = condor.Schedd(classad.ClassAd('[Name="silent"; ScheddIpAddr="<127.0.0.1:%d>"]' % silent.getsockname()[1]))
+        job = self.sleep_job()
+        for call in [lambda: schedd.query("true", [], 2),
+                     lambda: schedd.submit(job, 1, 2),
+                     lambda: schedd.edit("true", "Foo", "1", 2),
+                     lambda: schedd.act(condor.JobAction.Hold, "true", None, 2)]:
+            start = time.time()
+            self.assertRaises(IOError, call)
+            self.assertTrue(time.time() - start < 10)
+        # Without a timeout, act can still be cancelled.
+        canceller = threading.Timer(1, schedd.cancel)
+        canceller.start()
+        start = time.time()
+        self.assertRaises(IOError, schedd.act, condor.JobAction.Hold, "true")
+        self.assertTrue(time.time() - start < 10)
+        canceller.join()
+        silent.close()
+
+    def testCollectorHedge(self):
+        self.launch_daemons(["COLLECTOR"])
+        # Listed first, a collector that accepts the query but never answers.
+        silent = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        silent.bind(("127.0.0.1", 0))
+        silent.listen(5)
+        with self.config(SEC_CLIENT_NEGOTIATION="NEVER", PYTHON_COLLECTOR_HEDGE="true"):
+            coll = condor.Collector("127.0.0.1:%d, %s" % (silent.getsockname()[1], condor.param["COLLECTOR_HOST"]))
+            before = condor.hedgeStats()
+            start = time.time()
+            ads = coll.query(condor.AdTypes.Collector, "true", [], 20)
+            self.assertTrue(time.time() - start < 10)
+            after = condor.hedgeStats()
+        silent.close()
+        self.assertTrue(ads)
+        self.assertEquals(after["Triggered"], before["Triggered"] + 1)
+        self.assertEquals(after["Won"], before["Won"] + 1)
+
+    def testScheddQueryShards(self):
+        schedd = self.launch_schedd()
+        schedd.submitMany([self.sleep_job(Idx=i) for i in range(10)], 2)
+        jobs = schedd.query("Idx =!= undefined", ["ClusterId", "ProcId", "Idx"])
+        sharded = schedd.query("Idx =!= undefined", ["ClusterId", "ProcId", "Idx"], 0, 4)
+        self.assertEquals(len(sharded), 10)
+        self.assertEquals(sorted([j["Idx"] for j in sharded]), sorted([j["Idx"] for j in jobs]))
+
+    def testScheddQueryShardsConcurrent(self):
+        schedd = self.launch_schedd()
+        jobs = []
+        for i in range(20):
+            job = self.sleep_job(Idx=i)
+            # Expressions, unlike literals, go through the parser when decoded.
+            job.update(classad.ClassAd('[Requirements = TARGET.Memory >= %d && TARGET.Arch == "X86_64"]' % i))
+            jobs.append(job)
+        schedd.submitMany(jobs, 5)
+        attrs = ["ClusterId", "ProcId", "Idx", "Requirements"]
+        expected = sorted([(j["Idx"], str(j.lookup("Requirements"))) for j in schedd.query("Idx =!= undefined", attrs)])
+        results, errors = [], []
+        def query():
+            try:
+                for i in range(5):
+                    sharded = schedd.query("Idx =!= undefined", attrs, 0, 4)
+                    results.append(sorted([(j["Idx"], str(j.lookup("Requirements"))) for j in sharded]))
+            except Exception, e:
+                errors.append(e)
+        threads = [threading.Thread(target=query) for i in range(4)]
+        for thread in threads: thread.start()
+        for thread in threads: thread.join()
+        self.assertEquals(errors, [])
+        self.assertEquals(len(results), 20)
+        for result in results:
+            self.assertEquals(result, expected)
 
     def testCollectorAdvertise(self):
         self.launch_daemons(["COLLECTOR"])
@@ -168,6 +400,217 @@ class TestWithDaemons(unittest.TestCase):
         self.assertEquals(ads[0]["Bar"], now)
         self.assertTrue("Foo" not in ads[0])
 
+    def testCollectorAdvertiseWithAck(self):
+        self.launch_daemons(["COLLECTOR"])
+        coll = condor.Collector()
+        ads = [classad.ClassAd('[MyType="Machine"; Name="slot%d@acked"; Machine="acked"; MyAddress="<127.0.0.1:9618>"; Idx=%d]' % (i, i)) for i in range(10)]
+        with self.config(PYTHON_ADVERTISE_ACK_WINDOW=4):
+            coll.advertise(ads, "UPDATE_STARTD_AD_WITH_ACK")
+        # Acknowledged ads are in the collector as soon as advertise returns.
+        ads = coll.query(condor.AdTypes.Startd, 'Machine =?= "acked"', ["Idx"])
+        self.assertEquals(sorted([ad["Idx"] for ad in ads]), range(10))
+
+    def testCollectorWatch(self):
+        self.launch_daemons(["COLLECTOR"])
+        coll = condor.Collector()
+        watch = coll.watch(condor.AdTypes.Generic, 'Name =?= "Foo" || Name =?= "Bar"')
+        coll.advertise([classad.ClassAd('[MyType="GenericAd"; Name="%s"; Foo=1]' % name) for name in ["Foo", "Bar"]])
+        changes = []
+        for i in range(10):
+            changes += watch.poll()
+            if len(changes) == 2: break
+            time.sleep(1)
+        self.assertEquals(sorted([ad["Name"] for change, ad, attrs in changes]), ["Bar", "Foo"])
+        self.assertEquals(set([change for change, ad, attrs in changes]), set([condor.AdChange.Added]))
+        self.assertEquals(watch.poll(), [])
+        coll.advertise([classad.ClassAd('[MyType="GenericAd"; Name="Foo"; Foo=2]')])
+        changes = watch.poll()
+        self.assertEquals(len(changes), 1)
+        self.assertEquals(changes[0][0], condor.AdChange.Changed)
+        self.assertEquals(changes[0][1]["Foo"], 2)
+        self.assertEquals(list(changes[0][2]), ["Foo"])
+        self.assertEquals(len(watch), 2)
+
+    def testCollectorWatchAnyType(self):
+        self.launch_daemons(["COLLECTOR"])
+        coll = condor.Collector()
+        watch = coll.watch(condor.AdTypes.Any, 'Name =?= "Shared"', ["Foo"])
+        coll.advertise([classad.ClassAd('[MyType="%s"; Name="Shared"; Foo=1]' % my_type) for my_type in ["GenericAd", "OtherAd"]])
+        changes = []
+        for i in range(10):
+            changes += watch.poll()
+            if len(changes) == 2: break
+            time.sleep(1)
+        self.assertEquals(sorted([ad["MyType"] for change, ad, attrs in changes]), ["GenericAd", "OtherAd"])
+        self.assertEquals(set([change for change, ad, attrs in changes]), set([condor.AdChange.Added]))
+        self.assertEquals(len(watch), 2)
+        coll.advertise([classad.ClassAd('[MyType="OtherAd"; Name="Shared"; Foo=2]')])
+        changes = watch.poll()
+        self.assertEquals(len(changes), 1)
+        self.assertEquals(changes[0][1]["MyType"], "OtherAd")
+        self.assertEquals(list(changes[0][2]), ["Foo"])
+
+    def testAdvertiser(self):
+        self.launch_daemons(["COLLECTOR"])
+        coll = condor.Collector()
+        advertiser = condor.Advertiser("", "UPDATE_AD_GENERIC", True, 0.1)
+        try:
+            advertiser.update([classad.ClassAd('[MyType="GenericAd"; Name="Advertised"; Foo=1]')])
+            for i in range(10):
+                ads = coll.query(condor.AdTypes.Any, 'Name =?= "Advertised"', ["Foo"])
+                if ads: break
+                time.sleep(0.5)
+            self.assertEquals(ads[0]["Foo"], 1)
+            sent = advertiser.updatesSent
+            advertiser.update([classad.ClassAd('[MyType="GenericAd"; Name="Advertised"; Foo=1]')])
+            time.sleep(1)
+            self.assertEquals(advertiser.updatesSent, sent)
+            advertiser.update([classad.ClassAd('[MyType="GenericAd"; Name="Advertised"; Foo=2]')])
+            for i in range(10):
+                ads = coll.query(condor.AdTypes.Any, 'Name =?= "Advertised"', ["Foo"])
+                if ads[0]["Foo"] == 2: break
+                time.sleep(0.5)
+            self.assertEquals(ads[0]["Foo"], 2)
+            self.assertEquals(advertiser.lastError, "")
+        finally:
+            advertiser.stop()
+
+    def testAdvertiserSharedName(self):
+        self.launch_daemons(["COLLECTOR"])
+        coll = condor.Collector()
+        advertiser = condor.Advertiser("", "UPDATE_AD_GENERIC", True, 0.1)
+        try:
+            advertiser.update([classad.ClassAd('[MyType="GenericAd"; Name="SharedName"; Foo=1]'),
+                classad.ClassAd('[MyType="OtherAd"; Name="SharedName"; Foo=2]')])
+            for i in range(10):
+                ads = coll.query(condor.AdTypes.Any, 'Name =?= "SharedName"', ["MyType", "Foo"])
+                if len(ads) == 2: break
+                time.sleep(0.5)
+            self.assertEquals(sorted([(ad["MyType"], ad["Foo"]) for ad in ads]), [("GenericAd", 1), ("OtherAd", 2)])
+            sent = advertiser.updatesSent
+            advertiser.remove("SharedName", "OtherAd")
+            advertiser.update([classad.ClassAd('[MyType="GenericAd"; Name="SharedName"; Foo=3]')])
+            for i in range(10):
+                if advertiser.updatesSent > sent: break
+                time.sleep(0.5)
+            self.assertEquals(advertiser.updatesSent, sent + 1)
+        finally:
+            advertiser.stop()
+
+    def testCollectorQuerySharedStrings(self):
+        self.launch_daemons(["COLLECTOR"])
+        coll = condor.Collector()
+        ads = []
+        for i in range(3):
+            ads.append(classad.ClassAd('[MyType="GenericAd"; Name="Shared%d"; Arch="X86_64"; OpSys="LINUX"; Idx=%d]' % (i, i)))
+        coll.advertise(ads, "UPDATE_AD_GENERIC", True)
+        for i in range(5):
+            results = coll.query(condor.AdTypes.Any, 'Arch =?= "X86_64"', ["Name", "Arch", "OpSys", "Idx"])
+            if len(results) == 3: break
+            time.sleep(1)
+        self.assertEquals(len(results), 3)
+        results.sort(key=lambda ad: ad["Idx"])
+        for i in range(3):
+            self.assertEquals(results[i]["Name"], "Shared%d" % i)
+            self.assertEquals(results[i]["Arch"], "X86_64")
+            self.assertEquals(results[i]["OpSys"], "LINUX")
+        results[0]["Arch"] = "INTEL"
+        self.assertEquals(results[1]["Arch"], "X86_64")
+
+    def testCollectorQueryDecodeThreads(self):
+        self.launch_daemons(["COLLECTOR"])
+        coll = condor.Collector()
+        coll.advertise([classad.ClassAd('[MyType="GenericAd"; Name="Decode%d"; Idx=%d]' % (i, i)) for i in range(300)], "UPDATE_AD_GENERIC", True)
+        for i in range(5):
+            ads = coll.query(condor.AdTypes.Any, 'Idx =!= undefined', ["Name", "Idx"])
+            if len(ads) == 300: break
+            time.sleep(1)
+        with self.config(PYTHON_QUERY_DECODE_THREADS=1):
+            single = [ad["Name"] for ad in coll.query(condor.AdTypes.Any, 'Idx =!= undefined', ["Name", "Idx"])]
+        with self.config(PYTHON_QUERY_DECODE_THREADS=4):
+            ads = coll.query(condor.AdTypes.Any, 'Idx =!= undefined', ["Name", "Idx"])
+        self.assertEquals([ad["Name"] for ad in ads], single)
+        self.assertEquals(sorted([ad["Idx"] for ad in ads]), range(300))
+
+    def testWireRecordReplay(self):
+        self.launch_daemons(["COLLECTOR"])
+        coll = condor.Collector()
+        coll.advertise([classad.ClassAd('[MyType="GenericAd"; Name="Recorded"; Foo=1]')])
+        record_file = os.path.join(os.getcwd(), "tests_tmp", "wire.log")
+        if os.path.exists(record_file): os.unlink(record_file)
+        for i in range(5):
+            if coll.query(condor.AdTypes.Any, 'Name =?= "Recorded"', ["Foo"]): break
+            time.sleep(1)
+        with self.config(PYTHON_WIRE_RECORD=record_file):
+            self.assertEquals(coll.query(condor.AdTypes.Any, 'Name =?= "Recorded"', ["Foo"])[0]["Foo"], 1)
+        coll.advertise([classad.ClassAd('[MyType="GenericAd"; Name="Recorded"; Foo=2]')])
+        with self.config(PYTHON_WIRE_REPLAY=record_file):
+            ads = coll.query(condor.AdTypes.Any, 'Name =?= "Recorded"', ["Foo"])
+            self.assertEquals(len(ads), 1)
+            self.assertEquals(ads[0]["Foo"], 1)
+            self.assertEquals(coll.query(condor.AdTypes.Any, 'Name =?= "Recorded"', ["Foo"], lazy=True)[0]["Foo"], 1)
+            self.assertRaises(IOError, coll.query, condor.AdTypes.Any, 'Name =?= "Other"')
+
+    def testScheddWireReplay(self):
+        self.launch_schedd()
+        condor.Schedd().submit(self.sleep_job(Recorded=1), 3)
+        record_file = os.path.join(os.getcwd(), "tests_tmp", "schedd_wire.log")
+        if os.path.exists(record_file): os.unlink(record_file)
+        attrs = ["ClusterId", "ProcId", "Recorded"]
+        with self.config(PYTHON_WIRE_RECORD=record_file):
+            recorded = condor.Schedd().query("Recorded =?= 1", attrs)
+        self.assertEquals(len(recorded), 3)
+        # Replay must not need the schedd, nor any way to locate it.
+        self.stop_daemons()
+        with self.config(PYTHON_WIRE_REPLAY=record_file, SCHEDD_ADDRESS_FILE="/nonexistent", COLLECTOR_HOST="127.0.0.1:1"):
+            replayed = condor.Schedd().query("Recorded =?= 1", attrs)
+        ids = lambda jobs: set([(job["ClusterId"], job["ProcId"], job["Recorded"]) for job in jobs])
+        self.assertEquals(len(replayed), len(recorded))
+        self.assertEquals(ids(replayed), ids(recorded))
+
+    def testCollectorLazyQuery(self):
+        self.launch_daemons(["COLLECTOR"])
+        coll = condor.Collector()
+        coll.advertise([classad.ClassAd('[MyType="GenericAd"; Name="Lazy"; Foo=1; Bar="baz"; Baz=Foo+1]')])
+        for i in range(5):
+            ads = coll.query(condor.AdTypes.Any, 'Name =?= "Lazy"', lazy=True)
+            if ads: break
+            time.sleep(1)
+        self.assertEquals(len(ads), 1)
+        ad = ads[0]
+        pending = ad.pending
+        self.assertTrue(pending > 0)
+        self.assertEquals(ad["Bar"], "baz")
+        self.assertEquals(ad.pending, pending-1)
+        self.assertTrue("Foo" in ad)
+        self.assertEquals(ad.eval("Baz"), 2)
+        self.assertEquals(ad.pending, 0)
+        self.assertEquals(len(ad), len(ad.keys()))
+        self.assertEquals(ad["MyType"], "GenericAd")
+        projected = coll.query(condor.AdTypes.Any, 'Name =?= "Lazy"', ["Name", "Foo"], lazy=True)[0]
+        self.assertEquals(dict(projected.items()), {"Name": "Lazy", "Foo": 1})
+
+    def testCollectorQueryCache(self):
+        self.launch_daemons(["COLLECTOR"])
+        cache_dir = os.path.join(os.getcwd(), "tests_tmp", "query_cache")
+        shutil.rmtree(cache_dir, True)
+        with self.config(PYTHON_QUERY_CACHE_DIR=cache_dir, PYTHON_QUERY_CACHE_TTL=600):
+            coll = condor.Collector()
+            coll.advertise([classad.ClassAd('[MyType="GenericAd"; Name="Cached"; Foo=1; Bar="baz"]')])
+            for i in range(5):
+                ads = coll.query(condor.AdTypes.Any, 'Name =?= "Cached"', ["Foo", "Bar"])
+                if ads: break
+                shutil.rmtree(cache_dir, True)
+                time.sleep(1)
+            self.assertEquals(len(ads), 1)
+            coll.advertise([classad.ClassAd('[MyType="GenericAd"; Name="Cached"; Foo=2; Bar="baz"]')])
+            time.sleep(1)
+            ads = coll.query(condor.AdTypes.Any, 'Name =?= "Cached"', ["Foo", "Bar"])
+            self.assertEquals(ads[0]["Foo"], 1)
+            self.assertEquals(ads[0]["Bar"], "baz")
+            ads = coll.query(condor.AdTypes.Any, 'Name =?= "Cached"', ["Foo"])
+            self.assertEquals(ads[0]["Foo"], 2)
+
 if __name__ == '__main__':
     unittest.main()
 